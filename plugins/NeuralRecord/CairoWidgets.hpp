@@ -13,7 +13,11 @@
 
 #include <functional>
 #include <atomic>
+#include <vector>
+#include <algorithm>
+#include <complex>
 #include "Cairo.hpp"
+#include "fft.h"
 #include "extra/Runner.hpp"
 
 START_NAMESPACE_DISTRHO
@@ -334,6 +338,7 @@ public:
 
     explicit CairoProgressBar(SubWidget* const parent, CairoColourTheme &theme_)
         : CairoSubWidget(parent),
+          shadow(nullptr),
           theme(theme_)
           {
             init();
@@ -341,21 +346,48 @@ public:
 
     explicit CairoProgressBar(TopLevelWidget* const parent, CairoColourTheme &theme_)
         : CairoSubWidget(parent),
+          shadow(nullptr),
           theme(theme_)
           {
             init();
           }
 
+    // only store the value, the UI repaint it on the next frame
     void setValue(float v)
     {
-        value = v;
-        repaint();
+        if (v != value) {
+            value = v;
+            dirty = true;
+        }
+    }
+
+    // repaint when the value changed since the last frame
+    void flush()
+    {
+        if (dirty) {
+            dirty = false;
+            repaint();
+        }
+    }
+
+    ~CairoProgressBar() {
+        cairo_surface_destroy(shadow);
     }
 
 protected:
     void init()
     {
         value = 0.0f;
+        dirty = false;
+    }
+
+    // the inset shadow is static, render it once per size
+    void drawShadowImage(int width, int height)
+    {
+        shadow = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        cairo_t *cri = cairo_create (shadow);
+        theme.boxShadowInset(cri, width, height);
+        cairo_destroy(cri);
     }
 
     void onCairoDisplay(const CairoGraphicsContext& context) override
@@ -387,14 +419,25 @@ protected:
         cairo_show_text(cr, s);
         cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
         cairo_new_path (cr);
-        theme.boxShadowInset(cr, width, height);
+        if (!shadow) drawShadowImage(width, height);
+        cairo_set_source_surface (cr, shadow, 0, 0);
+        cairo_paint (cr);
         cairo_pop_group_to_source (cr);
         cairo_paint (cr);
     }
 
+    void onResize(const ResizeEvent& ev) override
+    {
+        cairo_surface_destroy(shadow);
+        shadow = nullptr;
+        drawShadowImage(ev.size.getWidth(), ev.size.getHeight());
+    }
+
 private:
+    cairo_surface_t* shadow;
     CairoColourTheme &theme;
     float value;
+    bool dirty;
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CairoProgressBar)
 };
 
@@ -407,6 +450,7 @@ public:
     explicit CairoPeekMeter(SubWidget* const parent, CairoColourTheme &theme_)
         : CairoSubWidget(parent),
           image(nullptr),
+          scale(nullptr),
           theme(theme_)
           {
             init();
@@ -415,19 +459,33 @@ public:
     explicit CairoPeekMeter(TopLevelWidget* const parent, CairoColourTheme &theme_)
         : CairoSubWidget(parent),
           image(nullptr),
+          scale(nullptr),
           theme(theme_)
           {
             init();
           }
 
+    // keep the highest value since the last frame, the UI repaint it on the next frame
     void setValue(float v)
     {
-        value = v;
-        repaint();
+        if (!dirty || v > value) value = v;
+        dirty = true;
+    }
+
+    // repaint when a value came in since the last frame, or while the bar
+    // and the peak hold still fall off, the plugin only send changes
+    void flush()
+    {
+        const float floor = 20.*log10(0.00021); // -70db
+        if (dirty || std_value > std::max(value, floor) || (value <= floor && old_value > floor)) {
+            dirty = false;
+            repaint();
+        }
     }
 
     ~CairoPeekMeter() {
         cairo_surface_destroy(image);
+        cairo_surface_destroy(scale);
     }
 
 protected:
@@ -436,6 +494,7 @@ protected:
         old_value = -70.0f;
         std_value = -70.0f;
         value = -70.0f;
+        dirty = false;
     }
 
     float power2db(float power)
@@ -581,6 +640,16 @@ protected:
         cairo_stroke(cr);
     }
 
+    // the scale and the inset shadow are static, render them once per size
+    void drawScaleImage(int width, int height)
+    {
+        scale = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height*2);
+        cairo_t *cri = cairo_create (scale);
+        drawMeterScale(cri, height, width, height * 0.5);
+        theme.boxShadowInset(cri, width, height*2);
+        cairo_destroy(cri);
+    }
+
     void onCairoDisplay(const CairoGraphicsContext& context) override
     {
         cairo_t* const cr = context.handle;
@@ -590,6 +659,8 @@ protected:
         const int width = sz.getWidth();
         const int height = sz.getHeight() * 0.5;
 
+        if (!image) drawMeterImage(width, height);
+        if (!scale) drawScaleImage(width, height);
         double meterstate = logMeter(power2db(value));
         double oldstate = logMeter(old_value);
         cairo_set_source_surface (cr, image, 0, height * 0.5);
@@ -601,8 +672,8 @@ protected:
 
         cairo_rectangle(cr,(width*oldstate)-3, height * 0.5, 3, height * 0.5);
         cairo_fill(cr);
-        drawMeterScale(cr, height, width, height * 0.5);
-        theme.boxShadowInset(cr, width, height*2);
+        cairo_set_source_surface (cr, scale, 0, 0);
+        cairo_paint (cr);
         cairo_pop_group_to_source (cr);
         cairo_paint (cr);
     }
@@ -611,13 +682,18 @@ protected:
     {
         cairo_surface_destroy(image);
         image = nullptr;
+        cairo_surface_destroy(scale);
+        scale = nullptr;
         drawMeterImage(ev.size.getWidth(), ev.size.getHeight() * 0.5);
+        drawScaleImage(ev.size.getWidth(), ev.size.getHeight() * 0.5);
     }
 
 private:
     cairo_surface_t* image;
+    cairo_surface_t* scale;
     CairoColourTheme &theme;
     float value;
+    bool dirty;
     float old_value;
     float std_value;
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CairoPeekMeter)
@@ -625,6 +701,404 @@ private:
 
 // -----------------------------------------------------------------------
 
+class CairoWaveView : public CairoSubWidget
+{
+public:
+
+    explicit CairoWaveView(SubWidget* const parent, CairoColourTheme &theme_)
+        : CairoSubWidget(parent),
+          shadow(nullptr),
+          theme(theme_)
+          {
+            init();
+          }
+
+    explicit CairoWaveView(TopLevelWidget* const parent, CairoColourTheme &theme_)
+        : CairoSubWidget(parent),
+          shadow(nullptr),
+          theme(theme_)
+          {
+            init();
+          }
+
+    ~CairoWaveView() {
+        cairo_surface_destroy(shadow);
+    }
+
+    // start a new take of length bins, level 0 of the pyramid hold the bins,
+    // each level above the min/max of two bins of the level below
+    void clear(int length)
+    {
+        levels.clear();
+        int n = std::max(1, length);
+        for (;;) {
+            levels.push_back(std::vector<MinMax>(n, MinMax {1e9f, -1e9f, 1e9f, -1e9f}));
+            if (n == 1) break;
+            n = (n + 1) / 2;
+        }
+        dirty = true;
+    }
+
+    // store a bin and update its parents, the UI repaint on the next frame
+    void setBin(int pos, float tmin, float tmax, float smin, float smax)
+    {
+        if (pos < 0 || pos >= int(levels[0].size())) return;
+        levels[0][pos] = MinMax {tmin, tmax, smin, smax};
+        for (unsigned int l = 1; l < levels.size(); l++) {
+            const std::vector<MinMax>& c = levels[l-1];
+            pos >>= 1;
+            MinMax m = c[pos*2];
+            if (pos*2+1 < int(c.size())) {
+                m.tmin = std::min(m.tmin, c[pos*2+1].tmin);
+                m.tmax = std::max(m.tmax, c[pos*2+1].tmax);
+                m.smin = std::min(m.smin, c[pos*2+1].smin);
+                m.smax = std::max(m.smax, c[pos*2+1].smax);
+            }
+            levels[l][pos] = m;
+        }
+        dirty = true;
+    }
+
+    // repaint when bins came in since the last frame
+    void flush()
+    {
+        if (dirty) {
+            dirty = false;
+            repaint();
+        }
+    }
+
+protected:
+    struct MinMax {
+        float tmin;
+        float tmax;
+        float smin;
+        float smax;
+    };
+
+    void init()
+    {
+        dirty = false;
+        clear(1);
+    }
+
+    void drawShadowImage(int width, int height)
+    {
+        shadow = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        cairo_t *cri = cairo_create (shadow);
+        theme.boxShadowInset(cri, width, height);
+        cairo_destroy(cri);
+    }
+
+    // min/max of the bins [b0, b1) from the pyramid level where a pixel covers
+    // at least one entry, so a column never touch more than a few entries
+    MinMax column(int b0, int b1, int level)
+    {
+        const std::vector<MinMax>& v = levels[level];
+        MinMax m = {1e9f, -1e9f, 1e9f, -1e9f};
+        const int e = std::min(int(v.size()), ((b1 - 1) >> level) + 1);
+        for (int i = b0 >> level; i < e; i++) {
+            m.tmin = std::min(m.tmin, v[i].tmin);
+            m.tmax = std::max(m.tmax, v[i].tmax);
+            m.smin = std::min(m.smin, v[i].smin);
+            m.smax = std::max(m.smax, v[i].smax);
+        }
+        return m;
+    }
+
+    void onCairoDisplay(const CairoGraphicsContext& context) override
+    {
+        cairo_t* const cr = context.handle;
+        cairo_push_group (cr);
+
+        const Size<uint> sz = getSize();
+        const int width = sz.getWidth();
+        const int height = sz.getHeight();
+        const double mid = height * 0.5;
+
+        theme.setCairoColour(cr, theme.idColourFrame);
+        cairo_paint(cr);
+
+        const int length = levels[0].size();
+        int level = 0;
+        while (level + 1 < int(levels.size()) && (2 << level) * width <= length) level++;
+
+        std::vector<MinMax> cols(width);
+        for (int x = 0; x < width; x++)
+            cols[x] = column(int(int64_t(x) * length / width),
+                             std::max(int(int64_t(x) * length / width) + 1, int(int64_t(x + 1) * length / width)), level);
+
+        // the stimulus in the back, the target above, clipped columns in red
+        theme.setCairoColour(cr, theme.idColourBackgroundProgress);
+        for (int x = 0; x < width; x++) {
+            if (cols[x].smin > cols[x].smax) continue;
+            const double y0 = mid - std::min(1.0f, cols[x].smax) * mid;
+            const double y1 = mid - std::max(-1.0f, cols[x].smin) * mid;
+            cairo_rectangle(cr, x, y0, 1, std::max(1.0, y1 - y0));
+        }
+        cairo_fill(cr);
+
+        for (int c = 0; c < 2; c++) {
+            if (c) cairo_set_source_rgba(cr, 0.8, 0.1, 0.1, 1.0);
+            else cairo_set_source_rgba(cr, 0.3, 0.6, 0.2, 0.8);
+            for (int x = 0; x < width; x++) {
+                if (cols[x].tmin > cols[x].tmax) continue;
+                if ((cols[x].tmax >= 0.999f || cols[x].tmin <= -0.999f) != bool(c)) continue;
+                const double y0 = mid - std::min(1.0f, cols[x].tmax) * mid;
+                const double y1 = mid - std::max(-1.0f, cols[x].tmin) * mid;
+                cairo_rectangle(cr, x, y0, 1, std::max(1.0, y1 - y0));
+            }
+            cairo_fill(cr);
+        }
+
+        if (!shadow) drawShadowImage(width, height);
+        cairo_set_source_surface (cr, shadow, 0, 0);
+        cairo_paint (cr);
+        cairo_pop_group_to_source (cr);
+        cairo_paint (cr);
+    }
+
+    void onResize(const ResizeEvent& ev) override
+    {
+        cairo_surface_destroy(shadow);
+        shadow = nullptr;
+        drawShadowImage(ev.size.getWidth(), ev.size.getHeight());
+    }
+
+private:
+    cairo_surface_t* shadow;
+    CairoColourTheme &theme;
+    std::vector<std::vector<MinMax> > levels;
+    bool dirty;
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CairoWaveView)
+};
+
+// -----------------------------------------------------------------------
+
+class CairoSpectrumView : public CairoSubWidget
+{
+public:
+
+    explicit CairoSpectrumView(SubWidget* const parent, CairoColourTheme &theme_)
+        : CairoSubWidget(parent),
+          grid(nullptr),
+          shadow(nullptr),
+          theme(theme_)
+          {
+            init();
+          }
+
+    explicit CairoSpectrumView(TopLevelWidget* const parent, CairoColourTheme &theme_)
+        : CairoSubWidget(parent),
+          grid(nullptr),
+          shadow(nullptr),
+          theme(theme_)
+          {
+            init();
+          }
+
+    ~CairoSpectrumView() {
+        cairo_surface_destroy(grid);
+        cairo_surface_destroy(shadow);
+    }
+
+    void setSampleRate(double sr)
+    {
+        rate = sr;
+        cairo_surface_destroy(grid);
+        grid = nullptr;
+        dirty = true;
+    }
+
+    // forget the averaged spectra, for a new take
+    void clear()
+    {
+        std::fill(sxx.begin(), sxx.end(), 0.0f);
+        std::fill(syy.begin(), syy.end(), 0.0f);
+        dirty = true;
+    }
+
+    // add a block of the stimulus (x) and the target (y), n must be a power of two.
+    // Both real signals go through one hann windowed complex fft, the power spectra
+    // are averaged exponentially.
+    void addBlock(const float *x, const float *y, int n)
+    {
+        if (n != int(win.size())) {
+            win.resize(n);
+            spec.resize(n);
+            sxx.assign(n / 2 + 1, 0.0f);
+            syy.assign(n / 2 + 1, 0.0f);
+            for (int k = 0; k < n; k++)
+                win[k] = 0.5 - 0.5 * cos(2.0 * M_PI * k / n);
+        }
+        for (int k = 0; k < n; k++)
+            spec[k] = std::complex<float>(x[k] * win[k], y[k] * win[k]);
+        profiler::fft(spec.data(), n);
+        // a full scale sine gives n/4 in its bin
+        const float scale = 16.0f / (float(n) * n);
+        for (int k = 0; k <= n / 2; k++) {
+            const std::complex<float> z = spec[k];
+            const std::complex<float> zc = std::conj(spec[(n - k) & (n - 1)]);
+            const std::complex<float> X = (z + zc) * 0.5f;
+            const std::complex<float> Y = (z - zc) * std::complex<float>(0.0f, -0.5f);
+            sxx[k] += 0.25f * (std::norm(X) * scale - sxx[k]);
+            syy[k] += 0.25f * (std::norm(Y) * scale - syy[k]);
+        }
+        dirty = true;
+    }
+
+    // repaint when blocks came in since the last frame
+    void flush()
+    {
+        if (dirty) {
+            dirty = false;
+            repaint();
+        }
+    }
+
+protected:
+    void init()
+    {
+        rate = 48000.0;
+        dirty = false;
+    }
+
+    double freqX(double f, int width)
+    {
+        return width * log(f / 20.0) / log(topFreq() / 20.0);
+    }
+
+    double topFreq()
+    {
+        return std::min(20000.0, rate * 0.5);
+    }
+
+    // the frequency grid at 100Hz, 1kHz and 10kHz and the 0dB line of the transfer
+    void drawGridImage(int width, int height)
+    {
+        grid = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        cairo_t *cri = cairo_create (grid);
+        theme.setCairoColour(cri, theme.idColourFrame);
+        cairo_paint(cri);
+        cairo_set_source_rgba(cri, 0.33, 0.33, 0.33, 0.6);
+        cairo_set_line_width(cri, 1);
+        for (double f = 100.0; f < topFreq(); f *= 10.0) {
+            cairo_move_to(cri, int(freqX(f, width)) + 0.5, 0);
+            cairo_line_to(cri, int(freqX(f, width)) + 0.5, height);
+        }
+        cairo_move_to(cri, 0, int(height * 0.5) + 0.5);
+        cairo_line_to(cri, width, int(height * 0.5) + 0.5);
+        cairo_stroke(cri);
+        cairo_set_font_size (cri, height * 0.14);
+        theme.setCairoColour(cri, theme.idColourForground, 0.6f);
+        const char* labels[] = {"100", "1k", "10k"};
+        int i = 0;
+        for (double f = 100.0; f < topFreq() && i < 3; f *= 10.0, i++) {
+            cairo_move_to(cri, freqX(f, width) + 2, height - 2);
+            cairo_show_text(cri, labels[i]);
+        }
+        cairo_destroy(cri);
+    }
+
+    void drawShadowImage(int width, int height)
+    {
+        shadow = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        cairo_t *cri = cairo_create (shadow);
+        theme.boxShadowInset(cri, width, height);
+        cairo_destroy(cri);
+    }
+
+    // one curve, the power of each pixel column averaged over the bins it covers,
+    // level in dB is mapped to the height by the given range
+    void drawCurve(cairo_t* const cr, int width, int height, int which, double lo, double hi)
+    {
+        const int bins = sxx.size();
+        const int n = (bins - 1) * 2;
+        bool drawing = false;
+        for (int x = 0; x < width; x++) {
+            const double f0 = 20.0 * pow(topFreq() / 20.0, double(x) / width);
+            const double f1 = 20.0 * pow(topFreq() / 20.0, double(x + 1) / width);
+            const int k0 = std::min(bins - 1, int(f0 * n / rate + 0.5));
+            const int k1 = std::min(bins, std::max(k0 + 1, int(f1 * n / rate + 0.5)));
+            double px = 0.0;
+            double py = 0.0;
+            for (int k = k0; k < k1; k++) {
+                px += sxx[k];
+                py += syy[k];
+            }
+            double db;
+            if (which == 0) db = 10.0 * log10(px / (k1 - k0) + 1e-12);
+            else if (which == 1) db = 10.0 * log10(py / (k1 - k0) + 1e-12);
+            else if (px > 1e-9 * (k1 - k0)) db = 10.0 * log10((py + 1e-12) / px);
+            else {
+                // no stimulus energy, no transfer to show
+                drawing = false;
+                continue;
+            }
+            const double y = height * (hi - std::max(lo, std::min(hi, db))) / (hi - lo);
+            if (drawing) cairo_line_to(cr, x, y);
+            else cairo_move_to(cr, x, y);
+            drawing = true;
+        }
+        cairo_stroke(cr);
+    }
+
+    void onCairoDisplay(const CairoGraphicsContext& context) override
+    {
+        cairo_t* const cr = context.handle;
+        cairo_push_group (cr);
+
+        const Size<uint> sz = getSize();
+        const int width = sz.getWidth();
+        const int height = sz.getHeight();
+
+        if (!grid) drawGridImage(width, height);
+        cairo_set_source_surface (cr, grid, 0, 0);
+        cairo_paint (cr);
+
+        if (!sxx.empty()) {
+            cairo_set_line_width(cr, 1.5);
+            // stimulus and target from -100 to 0 dB, the transfer magnitude from -24 to +24 dB
+            theme.setCairoColour(cr, theme.idColourBackgroundProgress);
+            drawCurve(cr, width, height, 0, -100.0, 0.0);
+            cairo_set_source_rgba(cr, 0.3, 0.6, 0.2, 0.9);
+            drawCurve(cr, width, height, 1, -100.0, 0.0);
+            theme.setCairoColour(cr, theme.idColourForgroundActive);
+            drawCurve(cr, width, height, 2, -24.0, 24.0);
+        }
+
+        if (!shadow) drawShadowImage(width, height);
+        cairo_set_source_surface (cr, shadow, 0, 0);
+        cairo_paint (cr);
+        cairo_pop_group_to_source (cr);
+        cairo_paint (cr);
+    }
+
+    void onResize(const ResizeEvent& ev) override
+    {
+        cairo_surface_destroy(grid);
+        cairo_surface_destroy(shadow);
+        grid = nullptr;
+        shadow = nullptr;
+        drawGridImage(ev.size.getWidth(), ev.size.getHeight());
+        drawShadowImage(ev.size.getWidth(), ev.size.getHeight());
+    }
+
+private:
+    cairo_surface_t* grid;
+    cairo_surface_t* shadow;
+    CairoColourTheme &theme;
+    std::vector<float> win;
+    std::vector<std::complex<float> > spec;
+    std::vector<float> sxx;
+    std::vector<float> syy;
+    double rate;
+    bool dirty;
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(CairoSpectrumView)
+};
+
+// -----------------------------------------------------------------------
+
 class CairoToolTip : public CairoSubWidget, public Runner
 {
 public:
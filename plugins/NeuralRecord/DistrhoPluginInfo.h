@@ -20,13 +20,16 @@
 #define DISTRHO_UI_USER_RESIZABLE       1
 
 #define DISTRHO_PLUGIN_IS_RT_SAFE       1
-#define DISTRHO_PLUGIN_NUM_INPUTS       1
+#define DISTRHO_PLUGIN_NUM_INPUTS       2
 #define DISTRHO_PLUGIN_NUM_OUTPUTS      1
 #define DISTRHO_PLUGIN_WANT_TIMEPOS     0
 #define DISTRHO_PLUGIN_WANT_PROGRAMS    1
+#define DISTRHO_PLUGIN_WANT_STATE       1
+#define DISTRHO_PLUGIN_WANT_FULL_STATE  1
 #define DISTRHO_PLUGIN_WANT_MIDI_INPUT  0
-#define DISTRHO_PLUGIN_WANT_MIDI_OUTPUT 0
+#define DISTRHO_PLUGIN_WANT_MIDI_OUTPUT 1
 #define DISTRHO_PLUGIN_WANT_PARAMETER_VALUE_CHANGE_REQUEST 1
+#define DISTRHO_PLUGIN_WANT_DIRECT_ACCESS 1
 
 #define DISTRHO_PLUGIN_LV2_CATEGORY "lv2:UtilityPlugin"
 #define DISTRHO_PLUGIN_VST3_CATEGORIES "Fx|Tools|Mono"
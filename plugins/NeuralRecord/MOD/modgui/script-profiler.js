@@ -5,6 +5,7 @@ function (event) {
     const popup = event.icon.find ('.popup');
 
     var position = "0";
+    var headroom = 0.0;
 
     function log_meter (db) {
         var def = 0.000001; /* Meter deflection %age */
@@ -48,8 +49,50 @@ function (event) {
                 state.css({width: `${position}%`});
                 state.text(`${position}%`);
                 break;
+            case 'NULLDEPTH':
+                if (value > -120.0) {
+                    popup.text(`Neural Record Null Test: null depth ${value.toFixed(1)} dB`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 2000); 
+                }
+                break;
+            case 'HEADROOM':
+                headroom = value;
+                break;
             case 'ERRORS':
-                if (value >= 3.0) {
+                if (value >= 11.0) {
+                    popup.text(`Neural Record Warning: no stimulus on the reference input, the target isn't corrected`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 10.0) {
+                    popup.text(`Neural Record Error: no takes found in sequence.txt`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 9.0) {
+                    popup.text(`Neural Record Error: the input clips, lower the reamp level by ${(1.0 - headroom).toFixed(1)} dB`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 8.0) {
+                    popup.text(`Neural Record Error: no finished capture to run the null test against`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 7.0) {
+                    popup.text(`Neural Record Error: dropouts found, the take was rejected`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 6.0) {
+                    popup.text(`Neural Record Warning: dropouts found, see the .dropouts.json file`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 5.0) {
+                    popup.text(`Neural Record Warning: resumed take didn't match, please check the target`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 4.0) {
+                    popup.text(`Neural Record Error: Couldn't find the input.wav file`);
+                    popup.css({display: 'block'});
+                    setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
+                } else if (value >= 3.0) {
                     popup.text(`Neural Record Error: Sample Rate mismatch, please use 48kHz`);
                     popup.css({display: 'block'});
                     setTimeout(function() { popup.css({display: 'none'}); }, 5000); 
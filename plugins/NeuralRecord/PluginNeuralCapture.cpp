@@ -14,12 +14,20 @@ START_NAMESPACE_DISTRHO
 // -----------------------------------------------------------------------
 
 PluginNeuralCapture::PluginNeuralCapture()
-    : Plugin(paramCount, presetCount, 0)  // paramCount param(s), presetCount program(s), 0 states
+    : Plugin(paramCount, presetCount, stateCount)  // paramCount param(s), presetCount program(s), stateCount states
 {
 
     profil = new profiler::Profil(1, [this] (const uint32_t index, float value) {this->setOutputParameterValue(index, value);},
-                                     [this] (const uint32_t index, float value) {this->requestParameterValueChange(index, value);});
+                                     [this] (const uint32_t index, float value) {this->requestParameterValueChange(index, value);},
+                                     [this] (const uint32_t frame, const uint8_t *data, const uint32_t size) {
+                                         MidiEvent ev;
+                                         ev.frame = frame;
+                                         ev.size = size;
+                                         memcpy(ev.data, data, size);
+                                         ev.dataExt = nullptr;
+                                         return this->writeMidiEvent(ev);});
     profil->set_samplerate(getSampleRate(), profil); // init the DSP class
+    profil->set_buffersize(getBufferSize(), profil);
 
     for (unsigned p = 0; p < paramCount; ++p) {
         Parameter param;
@@ -36,6 +44,20 @@ PluginNeuralCapture::~PluginNeuralCapture() {
 // -----------------------------------------------------------------------
 // Init
 
+/**
+  The second input is the reference, the reamp output looped straight back.
+  It is optional, hosts may leave it unconnected.
+*/
+void PluginNeuralCapture::initAudioPort(bool input, uint32_t index, AudioPort& port) {
+    if (input && index == 1) {
+        port.hints = kAudioPortIsSidechain;
+        port.name = "Reference";
+        port.symbol = "lv2_audio_in_2";
+        return;
+    }
+    Plugin::initAudioPort(input, index, port);
+}
+
 void PluginNeuralCapture::initParameter(uint32_t index, Parameter& parameter) {
     if (index >= paramCount)
         return;
@@ -71,9 +93,219 @@ void PluginNeuralCapture::initParameter(uint32_t index, Parameter& parameter) {
             parameter.shortName = "Error";
             parameter.symbol = "ERRORS";
             parameter.ranges.min = 0.0f;
-            parameter.ranges.max = 4.0f;
+            parameter.ranges.max = 11.0f;
+            parameter.hints = kParameterIsOutput;
+            break;
+        case paramResume:
+            parameter.name = "Resume";
+            parameter.shortName = "Resume";
+            parameter.symbol = "RESUME";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger|kParameterIsBoolean;
+            break;
+        case paramPasses:
+            parameter.name = "Passes";
+            parameter.shortName = "Passes";
+            parameter.symbol = "PASSES";
+            parameter.ranges.min = 1.0f;
+            parameter.ranges.max = 8.0f;
+            parameter.ranges.def = 1.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger;
+            break;
+        case paramReject:
+            parameter.name = "Reject Dropouts";
+            parameter.shortName = "Reject";
+            parameter.symbol = "REJECT";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger|kParameterIsBoolean;
+            break;
+        case paramExport:
+            parameter.name = "Export";
+            parameter.shortName = "Export";
+            parameter.symbol = "EXPORT";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 2.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger;
+            parameter.enumValues.count = 3;
+            parameter.enumValues.restrictedMode = true;
+            {
+                ParameterEnumerationValue* const values = new ParameterEnumerationValue[3];
+                parameter.enumValues.values = values;
+                values[0].label = "Off";
+                values[0].value = 0.0f;
+                values[1].label = "Float 32";
+                values[1].value = 1.0f;
+                values[2].label = "PCM 24";
+                values[2].value = 2.0f;
+            }
+            break;
+        case paramSplit:
+            parameter.name = "Validation Split";
+            parameter.shortName = "Split";
+            parameter.symbol = "SPLIT";
+            parameter.unit = "%";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 50.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger;
+            break;
+        case paramNull:
+            parameter.name = "Null Test";
+            parameter.shortName = "Null";
+            parameter.symbol = "NULLTEST";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger|kParameterIsBoolean;
+            break;
+        case paramNullDepth:
+            parameter.name = "Null Depth";
+            parameter.shortName = "Depth";
+            parameter.symbol = "NULLDEPTH";
+            parameter.unit = "dB";
+            parameter.ranges.min = -120.0f;
+            parameter.ranges.max = 20.0f;
+            parameter.ranges.def = -120.0f;
+            parameter.hints = kParameterIsOutput;
+            break;
+        case paramEsr:
+            parameter.name = "ESR";
+            parameter.shortName = "ESR";
+            parameter.symbol = "ESR";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 100.0f;
+            parameter.ranges.def = 0.0f;
             parameter.hints = kParameterIsOutput;
             break;
+        case paramFitEsr:
+            parameter.name = "Linear Fit ESR";
+            parameter.shortName = "Fit ESR";
+            parameter.symbol = "FITESR";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsOutput;
+            break;
+        case paramCalibrate:
+            parameter.name = "Calibrate";
+            parameter.shortName = "Calibrate";
+            parameter.symbol = "CALIBRATE";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger|kParameterIsBoolean;
+            break;
+        case paramTrim:
+            parameter.name = "Input Trim";
+            parameter.shortName = "Trim";
+            parameter.symbol = "TRIM";
+            parameter.unit = "dB";
+            parameter.ranges.min = -24.0f;
+            parameter.ranges.max = 24.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsOutput;
+            break;
+        case paramHeadroom:
+            parameter.name = "Headroom";
+            parameter.shortName = "Headroom";
+            parameter.symbol = "HEADROOM";
+            parameter.unit = "dB";
+            parameter.ranges.min = -24.0f;
+            parameter.ranges.max = 120.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsOutput;
+            break;
+        case paramSequence:
+            parameter.name = "Sequence";
+            parameter.shortName = "Sequence";
+            parameter.symbol = "SEQUENCE";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger|kParameterIsBoolean;
+            break;
+        case paramSettle:
+            parameter.name = "Settle Time";
+            parameter.shortName = "Settle";
+            parameter.symbol = "SETTLE";
+            parameter.unit = "s";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 30.0f;
+            parameter.ranges.def = 2.0f;
+            parameter.hints = kParameterIsAutomatable;
+            break;
+        case paramTake:
+            parameter.name = "Take";
+            parameter.shortName = "Take";
+            parameter.symbol = "TAKE";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 999.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsOutput|kParameterIsInteger;
+            break;
+        case paramFastStart:
+            parameter.name = "Fast Start";
+            parameter.shortName = "Fast";
+            parameter.symbol = "FASTSTART";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger|kParameterIsBoolean;
+            break;
+        case paramFormat:
+            parameter.name = "Target Format";
+            parameter.shortName = "Format";
+            parameter.symbol = "FORMAT";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 1.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger;
+            parameter.enumValues.count = 2;
+            parameter.enumValues.restrictedMode = true;
+            {
+                ParameterEnumerationValue* const values = new ParameterEnumerationValue[2];
+                parameter.enumValues.values = values;
+                values[0].label = "WAV PCM 24";
+                values[0].value = 0.0f;
+                values[1].label = "FLAC";
+                values[1].value = 1.0f;
+            }
+            break;
+        case paramStimulus:
+            parameter.name = "Stimulus";
+            parameter.shortName = "Stimulus";
+            parameter.symbol = "STIMULUS";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 99.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger;
+            break;
+        case paramReference:
+            parameter.name = "Reference";
+            parameter.shortName = "Reference";
+            parameter.symbol = "REFERENCE";
+            parameter.ranges.min = 0.0f;
+            parameter.ranges.max = 2.0f;
+            parameter.ranges.def = 0.0f;
+            parameter.hints = kParameterIsAutomatable|kParameterIsInteger;
+            parameter.enumValues.count = 3;
+            parameter.enumValues.restrictedMode = true;
+            {
+                ParameterEnumerationValue* const values = new ParameterEnumerationValue[3];
+                parameter.enumValues.values = values;
+                values[0].label = "Off";
+                values[0].value = 0.0f;
+                values[1].label = "Export";
+                values[1].value = 1.0f;
+                values[2].label = "Correct";
+                values[2].value = 2.0f;
+            }
+            break;
     }
 }
 
@@ -87,6 +319,19 @@ void PluginNeuralCapture::initProgramName(uint32_t index, String& programName) {
     }
 }
 
+/**
+  Init the state @a index.
+  The confirmed roundtrip latency, kept per sample rate and buffer size.
+*/
+void PluginNeuralCapture::initState(uint32_t index, State& state) {
+    if (index == stateLatency) {
+        state.key = "latency";
+        state.defaultValue = "";
+        state.label = "Latency";
+        state.hints = kStateIsOnlyForDSP;
+    }
+}
+
 // -----------------------------------------------------------------------
 // Internal data
 
@@ -97,6 +342,13 @@ void PluginNeuralCapture::sampleRateChanged(double newSampleRate) {
     fSampleRate = newSampleRate;
 }
 
+/**
+  Optional callback to inform the plugin about a buffer size change.
+*/
+void PluginNeuralCapture::bufferSizeChanged(uint32_t newBufferSize) {
+    profil->set_buffersize(newBufferSize, profil);
+}
+
 /**
   Get the current value of a parameter.
 */
@@ -123,6 +375,63 @@ void PluginNeuralCapture::setParameterValue(uint32_t index, float value) {
         case paramError:
             p_error = fParams[paramError];
             break;
+        case paramResume:
+            resume = fParams[paramResume];
+            break;
+        case paramPasses:
+            passes = fParams[paramPasses];
+            break;
+        case paramReject:
+            reject = fParams[paramReject];
+            break;
+        case paramExport:
+            exportformat = fParams[paramExport];
+            break;
+        case paramSplit:
+            split = fParams[paramSplit];
+            break;
+        case paramNull:
+            nulltest = fParams[paramNull];
+            break;
+        case paramNullDepth:
+            nulldepth = fParams[paramNullDepth];
+            break;
+        case paramEsr:
+            esr = fParams[paramEsr];
+            break;
+        case paramFitEsr:
+            fitesr = fParams[paramFitEsr];
+            break;
+        case paramCalibrate:
+            calibrate = fParams[paramCalibrate];
+            break;
+        case paramTrim:
+            trim = fParams[paramTrim];
+            break;
+        case paramHeadroom:
+            headroom = fParams[paramHeadroom];
+            break;
+        case paramSequence:
+            sequence = fParams[paramSequence];
+            break;
+        case paramSettle:
+            settle = fParams[paramSettle];
+            break;
+        case paramTake:
+            take = fParams[paramTake];
+            break;
+        case paramFastStart:
+            faststart = fParams[paramFastStart];
+            break;
+        case paramFormat:
+            format = fParams[paramFormat];
+            break;
+        case paramStimulus:
+            stimulus = fParams[paramStimulus];
+            break;
+        case paramReference:
+            reference = fParams[paramReference];
+            break;
     }
     profil->connect_ports(index, value, profil);
 }
@@ -145,8 +454,82 @@ void PluginNeuralCapture::setOutputParameterValue(uint32_t index, float value)
         case paramError:
             p_error = fParams[paramError];
             break;
+        case paramResume:
+            resume = fParams[paramResume];
+            break;
+        case paramPasses:
+            passes = fParams[paramPasses];
+            break;
+        case paramReject:
+            reject = fParams[paramReject];
+            break;
+        case paramExport:
+            exportformat = fParams[paramExport];
+            break;
+        case paramSplit:
+            split = fParams[paramSplit];
+            break;
+        case paramNull:
+            nulltest = fParams[paramNull];
+            break;
+        case paramNullDepth:
+            nulldepth = fParams[paramNullDepth];
+            break;
+        case paramEsr:
+            esr = fParams[paramEsr];
+            break;
+        case paramFitEsr:
+            fitesr = fParams[paramFitEsr];
+            break;
+        case paramCalibrate:
+            calibrate = fParams[paramCalibrate];
+            break;
+        case paramTrim:
+            trim = fParams[paramTrim];
+            break;
+        case paramHeadroom:
+            headroom = fParams[paramHeadroom];
+            break;
+        case paramSequence:
+            sequence = fParams[paramSequence];
+            break;
+        case paramSettle:
+            settle = fParams[paramSettle];
+            break;
+        case paramTake:
+            take = fParams[paramTake];
+            break;
+        case paramFastStart:
+            faststart = fParams[paramFastStart];
+            break;
+        case paramFormat:
+            format = fParams[paramFormat];
+            break;
+        case paramStimulus:
+            stimulus = fParams[paramStimulus];
+            break;
+        case paramReference:
+            reference = fParams[paramReference];
+            break;
     }
 }
+/**
+  Get the value of a state, the stored latencies.
+*/
+String PluginNeuralCapture::getState(const char* key) const {
+    if (std::strcmp(key, "latency") == 0)
+        return String(profil->latency_state(profil).c_str());
+    return String();
+}
+
+/**
+  Restore a state.
+*/
+void PluginNeuralCapture::setState(const char* key, const char* value) {
+    if (std::strcmp(key, "latency") == 0)
+        profil->restore_latency(value, profil);
+}
+
 /**
   Load a program.
   The host may call this function from any context,
@@ -173,15 +556,15 @@ void PluginNeuralCapture::activate() {
 void PluginNeuralCapture::run(const float** inputs, float** outputs,
                               uint32_t frames) {
 
-    // get the left and right audio inputs
+    // get the audio input and the reference input
     const float* const inpL = inputs[0];
-   // const float* const inpR = inputs[1];
+    const float* const inpR = inputs[1];
 
     // get the left and right audio outputs
     float* const outL = outputs[0];
    // float* const outR = outputs[1];
 
-    profil->mono_audio(static_cast<int>(frames), inpL, outL, profil);
+    profil->ref_audio(static_cast<int>(frames), inpL, inpR, outL, profil);
 }
 
 // -----------------------------------------------------------------------
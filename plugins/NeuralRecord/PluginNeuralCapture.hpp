@@ -39,13 +39,52 @@ public:
         paramState = 1,
         paramMeter = 2,
         paramError = 3,
+        paramResume = 4,
+        paramPasses = 5,
+        paramReject = 6,
+        paramExport = 7,
+        paramSplit = 8,
+        paramNull = 9,
+        paramNullDepth = 10,
+        paramEsr = 11,
+        paramFitEsr = 12,
+        paramCalibrate = 13,
+        paramTrim = 14,
+        paramHeadroom = 15,
+        paramSequence = 16,
+        paramSettle = 17,
+        paramTake = 18,
+        paramFastStart = 19,
+        paramFormat = 20,
+        paramStimulus = 21,
+        paramReference = 22,
         paramCount
     };
 
+    enum States {
+        stateLatency = 0,
+        stateCount
+    };
+
     PluginNeuralCapture();
 
     ~PluginNeuralCapture();
 
+    // the waveform bins of the running take, read by the UI
+    profiler::WaveRing* getWaveRing() {
+        return profil->wave_ring(profil);
+    }
+
+    // the stimulus/target blocks of the running take, read by the UI
+    profiler::SpecRing* getSpecRing() {
+        return profil->spec_ring(profil);
+    }
+
+    // the status events (errors, latency, finished captures), read by the UI
+    profiler::StatusRing* getStatusRing() {
+        return profil->status_ring(profil);
+    }
+
 protected:
     // -------------------------------------------------------------------
     // Information
@@ -86,8 +125,10 @@ protected:
     // -------------------------------------------------------------------
     // Init
 
+    void initAudioPort(bool input, uint32_t index, AudioPort& port) override;
     void initParameter(uint32_t index, Parameter& parameter) override;
     void initProgramName(uint32_t index, String& programName) override;
+    void initState(uint32_t index, State& state) override;
 
     // -------------------------------------------------------------------
     // Internal data
@@ -95,6 +136,8 @@ protected:
     float getParameterValue(uint32_t index) const override;
     void setParameterValue(uint32_t index, float value) override;
     void loadProgram(uint32_t index) override;
+    String getState(const char* key) const override;
+    void setState(const char* key, const char* value) override;
 
     void setOutputParameterValue(uint32_t index, float value);
 
@@ -104,6 +147,9 @@ protected:
     // Optional callback to inform the plugin about a sample rate change.
     void sampleRateChanged(double newSampleRate) override;
 
+    // Optional callback to inform the plugin about a buffer size change.
+    void bufferSizeChanged(uint32_t newBufferSize) override;
+
     // -------------------------------------------------------------------
     // Process
 
@@ -121,6 +167,25 @@ private:
     float           state;
     float           meter;
     float           p_error;
+    float           resume;
+    float           passes;
+    float           reject;
+    float           exportformat;
+    float           split;
+    float           nulltest;
+    float           nulldepth;
+    float           esr;
+    float           fitesr;
+    float           calibrate;
+    float           trim;
+    float           headroom;
+    float           sequence;
+    float           settle;
+    float           take;
+    float           faststart;
+    float           format;
+    float           stimulus;
+    float           reference;
     // pointer to dsp class
     profiler::Profil*  profil;
 
@@ -135,7 +200,7 @@ struct Preset {
 const Preset factoryPresets[] = {
     {
         "Default",
-        { 0.f, 0.f, 0.f, 0.f }
+        { 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 0.f, -120.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 2.f, 0.f, 0.f, 0.f, 0.f, 0.f }
     }
     //,{
     //    "Another preset",  // preset name
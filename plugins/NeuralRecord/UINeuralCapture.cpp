@@ -15,8 +15,10 @@ START_NAMESPACE_DISTRHO
 // Init / Deinit
 
 UINeuralCapture::UINeuralCapture()
-: UI(350, 250, true), theme() {
-    kInitialHeight = 250;
+: UI(350, 390, true), theme(), background(nullptr) {
+    fitDirty = false;
+    lastFrame = std::chrono::steady_clock::now();
+    kInitialHeight = 390;
     kInitialWidth = 350;
     sizeGroup = new UiSizeGroup(kInitialWidth, kInitialHeight);
     getPathInfo(pathInfo);
@@ -24,26 +26,57 @@ UINeuralCapture::UINeuralCapture()
     inputFile += pathInfo;
     inputFile += "input.wav";
 
-    outputFile = "Saved to ";
-    outputFile += pathInfo;
-    outputFile += "target.wav";
-
     fButton = new CairoButton(this, theme, dynamic_cast<UI*>(this), "Capture", PluginNeuralCapture::paramButton);
     sizeGroup->addToSizeGroup(fButton, 75, 30, 200, 50);
     
     fProgressBar = new CairoProgressBar(this, theme);
     sizeGroup->addToSizeGroup(fProgressBar, 75, 105, 200, 30);
     
+    // the recorded target over the stimulus, filled while the take runs
+    fWaveView = new CairoWaveView(this, theme);
+    sizeGroup->addToSizeGroup(fWaveView, 25, 145, 300, 60);
+
+    // stimulus and target spectrum and the transfer magnitude of the device
+    fSpectrum = new CairoSpectrumView(this, theme);
+    fSpectrum->setSampleRate(getSampleRate());
+    sizeGroup->addToSizeGroup(fSpectrum, 25, 215, 300, 70);
+
     fPeekMeter = new CairoPeekMeter(this, theme);
-    sizeGroup->addToSizeGroup(fPeekMeter, 75, 160, 200, 50);
+    sizeGroup->addToSizeGroup(fPeekMeter, 75, 295, 200, 50);
+
+    fResume = new CairoButton(this, theme, dynamic_cast<UI*>(this), "Resume", PluginNeuralCapture::paramResume);
+    sizeGroup->addToSizeGroup(fResume, 22, 355, 58, 25);
+
+    fNull = new CairoButton(this, theme, dynamic_cast<UI*>(this), "Null Test", PluginNeuralCapture::paramNull);
+    sizeGroup->addToSizeGroup(fNull, 84, 355, 58, 25);
+    nullEsr = 0.0f;
+
+    fCalibrate = new CairoButton(this, theme, dynamic_cast<UI*>(this), "Calibrate", PluginNeuralCapture::paramCalibrate);
+    sizeGroup->addToSizeGroup(fCalibrate, 146, 355, 58, 25);
+    headroom = 0.0f;
+
+    fSequence = new CairoButton(this, theme, dynamic_cast<UI*>(this), "Sequence", PluginNeuralCapture::paramSequence);
+    sizeGroup->addToSizeGroup(fSequence, 208, 355, 58, 25);
+    nullTest = false;
+
+    fFastStart = new CairoButton(this, theme, dynamic_cast<UI*>(this), "Fast Start", PluginNeuralCapture::paramFastStart);
+    sizeGroup->addToSizeGroup(fFastStart, 270, 355, 58, 25);
 
     fToolTip = new CairoToolTip(this, theme, "This is a Message");
     sizeGroup->addToSizeGroup(fToolTip, 0, 95, 350, 50);
 
+    // nobody read the rings while the UI was closed, drop the stale events
+    // and start the waveform over with the running take
+    openTime = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (PluginNeuralCapture* const plugin = static_cast<PluginNeuralCapture*>(getPluginInstancePointer())) {
+        profiler::StatusEvent ev;
+        while (plugin->getStatusRing()->pop(ev)) {}
+        plugin->getWaveRing()->resync();
+    }
 }
 
 UINeuralCapture::~UINeuralCapture() {
-
+    cairo_surface_destroy(background);
 }
 
 // -----------------------------------------------------------------------
@@ -57,32 +90,133 @@ void UINeuralCapture::parameterChanged(uint32_t index, float value) {
     switch (index) {
         case PluginNeuralCapture::paramButton:
             fButton->setValue(value);
+            if (value > 0.5f && !fitInfo.empty()) {
+                fitInfo.clear();
+                fitDirty = true;
+            }
             break;
         case PluginNeuralCapture::paramState:
             fProgressBar->setValue(value);
             if (value >=1.0) {
                 fButton->setValue(0.0f);
                 setParameterValue(PluginNeuralCapture::paramButton, 0.0f);
-            } else if (value > 0.9969) {
-                fToolTip->setLabel(outputFile.c_str());                
             }
             break;
         case PluginNeuralCapture::paramMeter:
             fPeekMeter->setValue(value);
             break;
         case PluginNeuralCapture::paramError:
-            // if ((int)value == 0) fToolTip->unset();
-            if ((int)value > 0) 
+            // errors come in as status events, see statusEvent()
+            break;
+        case PluginNeuralCapture::paramResume:
+            fResume->setValue(value);
+            break;
+        case PluginNeuralCapture::paramNull:
+            fNull->setValue(value);
+            nullTest = value > 0.5f;
+            break;
+        case PluginNeuralCapture::paramEsr:
+            nullEsr = value;
+            break;
+        case PluginNeuralCapture::paramCalibrate:
+            fCalibrate->setValue(value);
+            break;
+        case PluginNeuralCapture::paramHeadroom:
+            headroom = value;
+            break;
+        case PluginNeuralCapture::paramSequence:
+            fSequence->setValue(value);
+            break;
+        case PluginNeuralCapture::paramFastStart:
+            fFastStart->setValue(value);
+            break;
+        case PluginNeuralCapture::paramTake:
+            if (value > 0.0f) {
+                char s[64];
+                snprintf(s, 63, "Sequence take %d", (int)value);
+                takeInfo = s;
+                fToolTip->setLabel(takeInfo.c_str());
+            }
+            break;
+        case PluginNeuralCapture::paramTrim:
+            if (value != 0.0f) {
+                char s[128];
+                snprintf(s, 127, "Input trim %.1f dB, headroom %.1f dB", value, headroom);
+                levelInfo = s;
+                fToolTip->setLabel(levelInfo.c_str());
+            }
+            break;
+        case PluginNeuralCapture::paramFitEsr:
+            if (value > 0.0f) {
+                char s[64];
+                snprintf(s, 63, "Linear fit ESR %.4f", value);
+                fitInfo = s;
+                fitDirty = true;
+            }
+            break;
+        case PluginNeuralCapture::paramNullDepth:
+            if (value > -120.0f) {
+                char s[64];
+                snprintf(s, 63, "Null depth %.1f dB, ESR %.4f", value, nullEsr);
+                nullInfo = s;
+                fToolTip->setLabel(nullInfo.c_str());
+            }
+            break;
+    }
+}
+
+/**
+  A status event from the plugin, posted once when something changed.
+*/
+void UINeuralCapture::statusEvent(const profiler::StatusEvent& ev) {
+    char s[384];
+    switch (ev.type) {
+        case profiler::EV_ERROR:
+            if ((ev.code > 0 && ev.code < 5) || ev.code == 9) 
                 fButton->setValue(0.0f);
-            if ((int)value == 1) 
+            if (ev.code == 1) 
                 fToolTip->setLabel("Error: no signal comes in, stop the process here");
-            else if ((int)value == 2) 
+            else if (ev.code == 2) 
                 fToolTip->setLabel("Error: seems we receive garbage, stop the process here");
-            else if ((int)value == 3) 
+            else if (ev.code == 3) 
                 fToolTip->setLabel("Error: Sample Rate mismatch, please use 48kHz");
-            else if ((int)value == 4) 
+            else if (ev.code == 4) 
                 fToolTip->setLabel(inputFile.c_str());
-
+            else if (ev.code == 5) 
+                fToolTip->setLabel("Warning: resumed take didn't match, please check the target");
+            else if (ev.code == 6) 
+                fToolTip->setLabel("Warning: dropouts found, see the .dropouts.json file");
+            else if (ev.code == 7) 
+                fToolTip->setLabel("Error: dropouts found, the take was rejected");
+            else if (ev.code == 8) 
+                fToolTip->setLabel("Error: no finished capture to run the null test against");
+            else if (ev.code == 9) {
+                snprintf(s, 383, "Error: the input clips, lower the reamp level by %.1f dB", 1.0f - ev.value);
+                levelInfo = s;
+                fToolTip->setLabel(levelInfo.c_str());
+            }
+            else if (ev.code == 10) 
+                fToolTip->setLabel("Error: no takes found in sequence.txt");
+            else if (ev.code == 11) 
+                fToolTip->setLabel("Warning: no stimulus on the reference input, the target isn't corrected");
+            break;
+        case profiler::EV_LATENCY:
+            snprintf(s, 383, "Round trip latency %d samples, error %.3f", ev.code, ev.value);
+            latencyInfo = s;
+            fToolTip->setLabel(latencyInfo.c_str());
+            break;
+        case profiler::EV_CAPTURE:
+            if (std::fabs(ev.value - 1.0f) > 0.001f)
+                snprintf(s, 383, "Saved to %s, normalised by %.1f dB", ev.text, 20.0 * log10(ev.value));
+            else
+                snprintf(s, 383, "Saved to %s", ev.text);
+            outputFile = s;
+            fToolTip->setLabel(outputFile.c_str());
+            break;
+        case profiler::EV_OVERRUN:
+            snprintf(s, 383, "Warning: the disk couldn't keep up, %d chunks lost", ev.code);
+            levelInfo = s;
+            fToolTip->setLabel(levelInfo.c_str());
             break;
     }
 }
@@ -104,6 +238,7 @@ void UINeuralCapture::programLoaded(uint32_t index) {
   Optional callback to inform the UI about a sample rate change on the plugin side.
 */
 void UINeuralCapture::sampleRateChanged(double newSampleRate) {
+    fSpectrum->setSampleRate(newSampleRate);
     if (newSampleRate != 48000) fToolTip->setLabel("Sample Rate mismatch, please use 48kHz");
 }
 
@@ -139,9 +274,46 @@ void UINeuralCapture::getPathInfo(std::string &pInfo)
 /**
   Idle callback.
   This function is called at regular intervals.
+  Output parameters only mark the widgets dirty, here they get repainted,
+  at most FRAMERATE times a second.
 */
 void UINeuralCapture::uiIdle() {
-
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - lastFrame < std::chrono::milliseconds(1000 / FRAMERATE)) return;
+    lastFrame = now;
+    if (PluginNeuralCapture* const plugin = static_cast<PluginNeuralCapture*>(getPluginInstancePointer())) {
+        // the status events posted since the last frame, older ones belong to a closed UI
+        profiler::StatusEvent ev;
+        while (plugin->getStatusRing()->pop(ev))
+            if (ev.time >= openTime) statusEvent(ev);
+        // the waveform bins the plugin recorded since the last frame
+        profiler::WaveBin bins[256];
+        int n;
+        while ((n = plugin->getWaveRing()->pull(bins, 256)) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (bins[i].pos < 0) {
+                    fWaveView->clear(bins[i].length);
+                    fSpectrum->clear();
+                } else
+                    fWaveView->setBin(bins[i].pos, bins[i].tmin, bins[i].tmax, bins[i].smin, bins[i].smax);
+            }
+        }
+        // the stimulus/target blocks for the spectrum
+        profiler::SpecRing* const ring = plugin->getSpecRing();
+        while (const profiler::SpecBlock* const block = ring->front()) {
+            fSpectrum->addBlock(block->stim, block->target, SPECSIZE);
+            ring->pop();
+        }
+    }
+    fWaveView->flush();
+    fSpectrum->flush();
+    fProgressBar->flush();
+    fPeekMeter->flush();
+    if (fitDirty) {
+        // the fit info line above the capture button
+        fitDirty = false;
+        repaint(DGL::Rectangle<uint>(0, 0, getWidth(), getHeight() * 30 / kInitialHeight));
+    }
 }
 
 /**
@@ -155,6 +327,19 @@ void UINeuralCapture::uiReshape(uint width, uint height) {
 // -----------------------------------------------------------------------
 // Widget callbacks
 
+/**
+  Render the background and the box shadow, they only change with the size.
+*/
+void UINeuralCapture::drawBackground(int width, int height) {
+    cairo_surface_destroy(background);
+    background = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t *cri = cairo_create (background);
+    theme.setCairoColour(cri, theme.idColourBackground);
+    cairo_paint(cri);
+    theme.boxShadow(cri, width, height, 25, 25);
+    cairo_destroy(cri);
+}
+
 /**
   A function called to draw the view contents.
 */
@@ -163,10 +348,25 @@ void UINeuralCapture::onCairoDisplay(const CairoGraphicsContext& context) {
     int width = getWidth();
     int height = getHeight();
 
+    if (!background || cairo_image_surface_get_width(background) != width
+                    || cairo_image_surface_get_height(background) != height)
+        drawBackground(width, height);
+
     cairo_push_group (cr);
-    theme.setCairoColour(cr, theme.idColourBackground);
+    cairo_set_source_surface (cr, background, 0, 0);
     cairo_paint(cr);
-    theme.boxShadow(cr, width, height, 25, 25);
+    // the running ESR of the linear model fit, above the capture button
+    if (!fitInfo.empty()) {
+        const float scale = std::min(width / float(kInitialWidth), height / float(kInitialHeight));
+        cairo_text_extents_t extents;
+        theme.setCairoColour(cr, theme.idColourForground);
+        cairo_set_font_size (cr, 12.0 * scale);
+        cairo_select_font_face (cr, "Sans", CAIRO_FONT_SLANT_NORMAL,
+                                   CAIRO_FONT_WEIGHT_BOLD);
+        cairo_text_extents(cr, fitInfo.c_str(), &extents);
+        cairo_move_to (cr, (width - extents.width) * 0.5, height * 20.0 / kInitialHeight);
+        cairo_show_text(cr, fitInfo.c_str());
+    }
     cairo_pop_group_to_source (cr);
     cairo_paint (cr);
 }
@@ -174,6 +374,7 @@ void UINeuralCapture::onCairoDisplay(const CairoGraphicsContext& context) {
 void UINeuralCapture::onResize(const ResizeEvent& ev)
 {
     UI::onResize(ev);
+    drawBackground(ev.size.getWidth(), ev.size.getHeight());
     sizeGroup->resizeAspectSizeGroup(ev.size.getWidth(), ev.size.getHeight());
 }
 
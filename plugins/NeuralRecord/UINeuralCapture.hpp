@@ -11,6 +11,8 @@
 
 #include <functional>
 #include <list>
+#include <algorithm>
+#include <chrono>
 #include "DistrhoUI.hpp"
 #include "PluginNeuralCapture.hpp"
 #include "Cairo.hpp"
@@ -23,6 +25,8 @@
 #define PATH_SEPARATOR "/" 
 #endif
 
+#define FRAMERATE 30  // max repaints per second of the meter, progress bar and fit info
+
 START_NAMESPACE_DISTRHO
 
 /**
@@ -102,6 +106,7 @@ protected:
     void getPathInfo(std::string &pInfo);
     void parameterChanged(uint32_t, float value) override;
     void programLoaded(uint32_t index) override;
+    void statusEvent(const profiler::StatusEvent& ev);
     void sampleRateChanged(double newSampleRate) override;
 
     void uiIdle() override;
@@ -116,15 +121,36 @@ protected:
     void onResize(const ResizeEvent& ev) override;
 
 private:
+    void drawBackground(int width, int height);
+
     CairoColourTheme theme;
+    cairo_surface_t* background;
+    std::chrono::steady_clock::time_point lastFrame;
+    double openTime;
+    bool fitDirty;
     int kInitialHeight;
     int kInitialWidth;
     std::string pathInfo;
     std::string inputFile;
     std::string outputFile;
+    std::string nullInfo;
+    std::string fitInfo;
+    std::string levelInfo;
+    std::string takeInfo;
+    std::string latencyInfo;
+    float headroom;
+    float nullEsr;
+    bool nullTest;
     ScopedPointer<UiSizeGroup> sizeGroup;
     ScopedPointer<CairoButton> fButton;
+    ScopedPointer<CairoButton> fResume;
+    ScopedPointer<CairoButton> fNull;
+    ScopedPointer<CairoButton> fCalibrate;
+    ScopedPointer<CairoButton> fSequence;
+    ScopedPointer<CairoButton> fFastStart;
     ScopedPointer<CairoProgressBar> fProgressBar;
+    ScopedPointer<CairoWaveView> fWaveView;
+    ScopedPointer<CairoSpectrumView> fSpectrum;
     ScopedPointer<CairoPeekMeter> fPeekMeter;
     ScopedPointer<CairoToolTip> fToolTip;
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(UINeuralCapture)
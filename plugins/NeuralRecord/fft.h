@@ -0,0 +1,58 @@
+/*
+ * Neural Capture audio effect based on DISTRHO Plugin Framework (DPF)
+ *
+ * SPDX-License-Identifier:  GPL-2.0 license
+ *
+ * Copyright (C) 2023 brummer <brummer@web.de>
+ */
+
+#pragma once
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <complex>
+#include <cmath>
+#include <utility>
+
+namespace profiler {
+
+// small in place radix-2 fft, n must be a power of two
+inline void fft(std::complex<float> *x, int n) {
+    // bit reversed reorder
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(x[i], x[j]);
+    }
+    // butterflies, the twiddle recurrence runs in double to keep the error low
+    for (int len = 2; len <= n; len <<= 1) {
+        const double a = -2.0 * M_PI / len;
+        const std::complex<double> wl(cos(a), sin(a));
+        const int half = len >> 1;
+        std::complex<double> w(1.0, 0.0);
+        for (int k = 0; k < half; k++) {
+            const std::complex<float> wf(w.real(), w.imag());
+            for (int i = k; i < n; i += len) {
+                const std::complex<float> u = x[i];
+                const std::complex<float> v = x[i + half] * wf;
+                x[i] = u + v;
+                x[i + half] = u - v;
+            }
+            w *= wl;
+        }
+    }
+}
+
+// inverse of fft(), scaled by 1/n
+inline void ifft(std::complex<float> *x, int n) {
+    for (int i = 0; i < n; i++) x[i] = std::conj(x[i]);
+    fft(x, n);
+    const float s = 1.0f / n;
+    for (int i = 0; i < n; i++) x[i] = std::conj(x[i]) * s;
+}
+
+} // end namespace profiler
+
+#endif  // #ifndef FFT_H
@@ -0,0 +1,371 @@
+/*
+ * Neural Capture audio effect based on DISTRHO Plugin Framework (DPF)
+ *
+ * SPDX-License-Identifier:  GPL-2.0 license
+ *
+ * Copyright (C) 2023 brummer <brummer@web.de>
+ */
+
+#pragma once
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KERNELS_NEON 1
+#endif
+
+namespace profiler {
+
+// the hot loops of the capture, one table per instruction set.
+// The plug is build once per platform, the table is picked at runtime from the cpu features.
+struct Kernels
+{
+    const char *name;
+    // max absolute value
+    float  (*peak)(const float *x, int n);
+    // scale by a constant gain
+    void   (*gain)(float *x, float g, int n);
+    // dst += src
+    void   (*accumulate)(float *dst, const float *src, int n);
+    // sum of a * b, summed up in double
+    double (*dot)(const float *a, const float *b, int n);
+    // one output sample of the interpolating fir, the taps are h0 + fr * (h1 - h0)
+    float  (*fir)(const float *x, const float *h0, const float *h1, float fr, int taps);
+};
+
+// --------------------------------------------------------------------------------
+// plain c++, the fallback for every platform
+
+static float peak_scalar(const float *x, int n) {
+    float m = 0.0f;
+    for (int i = 0; i < n; i++) m = std::fmax(m, std::fabs(x[i]));
+    return m;
+}
+
+static void gain_scalar(float *x, float g, int n) {
+    for (int i = 0; i < n; i++) x[i] *= g;
+}
+
+static void accumulate_scalar(float *dst, const float *src, int n) {
+    for (int i = 0; i < n; i++) dst[i] += src[i];
+}
+
+static double dot_scalar(const float *a, const float *b, int n) {
+    double s = 0.0;
+    for (int i = 0; i < n; i++) s += double(a[i]) * b[i];
+    return s;
+}
+
+static float fir_scalar(const float *x, const float *h0, const float *h1, float fr, int taps) {
+    float s = 0.0f;
+    for (int k = 0; k < taps; k++) s += x[k] * (h0[k] + fr * (h1[k] - h0[k]));
+    return s;
+}
+
+static const Kernels kernels_scalar = {
+    "scalar", peak_scalar, gain_scalar, accumulate_scalar, dot_scalar, fir_scalar
+};
+
+#ifdef KERNELS_X86
+// --------------------------------------------------------------------------------
+// x86, each variant is compiled for its own target, the rest of the plug stays generic
+
+__attribute__((target("sse2")))
+static float peak_sse2(const float *x, int n) {
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 m = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) m = _mm_max_ps(m, _mm_and_ps(_mm_loadu_ps(x + i), mask));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    float r = _mm_cvtss_f32(m);
+    for (; i < n; i++) r = std::fmax(r, std::fabs(x[i]));
+    return r;
+}
+
+__attribute__((target("sse2")))
+static void gain_sse2(float *x, float g, int n) {
+    const __m128 vg = _mm_set1_ps(g);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), vg));
+    for (; i < n; i++) x[i] *= g;
+}
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(float *dst, const float *src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+    for (; i < n; i++) dst[i] += src[i];
+}
+
+__attribute__((target("sse2")))
+static double dot_sse2(const float *a, const float *b, int n) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128 va = _mm_loadu_ps(a + i);
+        const __m128 vb = _mm_loadu_ps(b + i);
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_cvtps_pd(va), _mm_cvtps_pd(vb)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(va, va)), _mm_cvtps_pd(_mm_movehl_ps(vb, vb))));
+    }
+    s0 = _mm_add_pd(s0, s1);
+    double r = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+    for (; i < n; i++) r += double(a[i]) * b[i];
+    return r;
+}
+
+__attribute__((target("sse2")))
+static float fir_sse2(const float *x, const float *h0, const float *h1, float fr, int taps) {
+    const __m128 vf = _mm_set1_ps(fr);
+    __m128 s = _mm_setzero_ps();
+    int k = 0;
+    for (; k + 4 <= taps; k += 4) {
+        const __m128 a = _mm_loadu_ps(h0 + k);
+        const __m128 h = _mm_add_ps(a, _mm_mul_ps(vf, _mm_sub_ps(_mm_loadu_ps(h1 + k), a)));
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(x + k), h));
+    }
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    float r = _mm_cvtss_f32(s);
+    for (; k < taps; k++) r += x[k] * (h0[k] + fr * (h1[k] - h0[k]));
+    return r;
+}
+
+static const Kernels kernels_sse2 = {
+    "sse2", peak_sse2, gain_sse2, accumulate_sse2, dot_sse2, fir_sse2
+};
+
+__attribute__((target("avx2,fma")))
+static float peak_avx2(const float *x, int n) {
+    const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) m = _mm256_max_ps(m, _mm256_and_ps(_mm256_loadu_ps(x + i), mask));
+    __m128 h = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_max_ss(h, _mm_shuffle_ps(h, h, 1));
+    float r = _mm_cvtss_f32(h);
+    for (; i < n; i++) r = std::fmax(r, std::fabs(x[i]));
+    return r;
+}
+
+__attribute__((target("avx2,fma")))
+static void gain_avx2(float *x, float g, int n) {
+    const __m256 vg = _mm256_set1_ps(g);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), vg));
+    for (; i < n; i++) x[i] *= g;
+}
+
+__attribute__((target("avx2,fma")))
+static void accumulate_avx2(float *dst, const float *src, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+    for (; i < n; i++) dst[i] += src[i];
+}
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const float *a, const float *b, int n) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a + i)), _mm256_cvtps_pd(_mm_loadu_ps(b + i)), s0);
+        s1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(a + i + 4)), _mm256_cvtps_pd(_mm_loadu_ps(b + i + 4)), s1);
+    }
+    s0 = _mm256_add_pd(s0, s1);
+    __m128d h = _mm_add_pd(_mm256_castpd256_pd128(s0), _mm256_extractf128_pd(s0, 1));
+    double r = _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+    for (; i < n; i++) r += double(a[i]) * b[i];
+    return r;
+}
+
+__attribute__((target("avx2,fma")))
+static float fir_avx2(const float *x, const float *h0, const float *h1, float fr, int taps) {
+    const __m256 vf = _mm256_set1_ps(fr);
+    __m256 s = _mm256_setzero_ps();
+    int k = 0;
+    for (; k + 8 <= taps; k += 8) {
+        const __m256 a = _mm256_loadu_ps(h0 + k);
+        const __m256 h = _mm256_fmadd_ps(vf, _mm256_sub_ps(_mm256_loadu_ps(h1 + k), a), a);
+        s = _mm256_fmadd_ps(_mm256_loadu_ps(x + k), h, s);
+    }
+    __m128 q = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    q = _mm_add_ps(q, _mm_movehl_ps(q, q));
+    q = _mm_add_ss(q, _mm_shuffle_ps(q, q, 1));
+    float r = _mm_cvtss_f32(q);
+    for (; k < taps; k++) r += x[k] * (h0[k] + fr * (h1[k] - h0[k]));
+    return r;
+}
+
+static const Kernels kernels_avx2 = {
+    "avx2", peak_avx2, gain_avx2, accumulate_avx2, dot_avx2, fir_avx2
+};
+
+// the avx512 headers of some gcc releases trip their own uninitialized warning
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f")))
+static float peak_avx512(const float *x, int n) {
+    __m512 m = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) m = _mm512_max_ps(m, _mm512_abs_ps(_mm512_loadu_ps(x + i)));
+    float r = _mm512_reduce_max_ps(m);
+    for (; i < n; i++) r = std::fmax(r, std::fabs(x[i]));
+    return r;
+}
+
+__attribute__((target("avx512f")))
+static void gain_avx512(float *x, float g, int n) {
+    const __m512 vg = _mm512_set1_ps(g);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_loadu_ps(x + i), vg));
+    for (; i < n; i++) x[i] *= g;
+}
+
+__attribute__((target("avx512f")))
+static void accumulate_avx512(float *dst, const float *src, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), _mm512_loadu_ps(src + i)));
+    for (; i < n; i++) dst[i] += src[i];
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const float *a, const float *b, int n) {
+    __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(a + i)), _mm512_cvtps_pd(_mm256_loadu_ps(b + i)), s0);
+        s1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(a + i + 8)), _mm512_cvtps_pd(_mm256_loadu_ps(b + i + 8)), s1);
+    }
+    double r = _mm512_reduce_add_pd(_mm512_add_pd(s0, s1));
+    for (; i < n; i++) r += double(a[i]) * b[i];
+    return r;
+}
+
+__attribute__((target("avx512f")))
+static float fir_avx512(const float *x, const float *h0, const float *h1, float fr, int taps) {
+    const __m512 vf = _mm512_set1_ps(fr);
+    __m512 s = _mm512_setzero_ps();
+    int k = 0;
+    for (; k + 16 <= taps; k += 16) {
+        const __m512 a = _mm512_loadu_ps(h0 + k);
+        const __m512 h = _mm512_fmadd_ps(vf, _mm512_sub_ps(_mm512_loadu_ps(h1 + k), a), a);
+        s = _mm512_fmadd_ps(_mm512_loadu_ps(x + k), h, s);
+    }
+    float r = _mm512_reduce_add_ps(s);
+    for (; k < taps; k++) r += x[k] * (h0[k] + fr * (h1[k] - h0[k]));
+    return r;
+}
+
+static const Kernels kernels_avx512 = {
+    "avx512", peak_avx512, gain_avx512, accumulate_avx512, dot_avx512, fir_avx512
+};
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#ifdef KERNELS_NEON
+// --------------------------------------------------------------------------------
+// arm, neon is part of every aarch64 cpu and of armhf builds with -mfpu=neon
+
+static float peak_neon(const float *x, int n) {
+    float32x4_t m = vdupq_n_f32(0.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) m = vmaxq_f32(m, vabsq_f32(vld1q_f32(x + i)));
+    float32x2_t h = vpmax_f32(vget_low_f32(m), vget_high_f32(m));
+    h = vpmax_f32(h, h);
+    float r = vget_lane_f32(h, 0);
+    for (; i < n; i++) r = std::fmax(r, std::fabs(x[i]));
+    return r;
+}
+
+static void gain_neon(float *x, float g, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) vst1q_f32(x + i, vmulq_n_f32(vld1q_f32(x + i), g));
+    for (; i < n; i++) x[i] *= g;
+}
+
+static void accumulate_neon(float *dst, const float *src, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+    for (; i < n; i++) dst[i] += src[i];
+}
+
+#ifdef __aarch64__
+static double dot_neon(const float *a, const float *b, int n) {
+    float64x2_t s0 = vdupq_n_f64(0.0), s1 = vdupq_n_f64(0.0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t va = vld1q_f32(a + i);
+        const float32x4_t vb = vld1q_f32(b + i);
+        s0 = vfmaq_f64(s0, vcvt_f64_f32(vget_low_f32(va)), vcvt_f64_f32(vget_low_f32(vb)));
+        s1 = vfmaq_f64(s1, vcvt_high_f64_f32(va), vcvt_high_f64_f32(vb));
+    }
+    double r = vaddvq_f64(vaddq_f64(s0, s1));
+    for (; i < n; i++) r += double(a[i]) * b[i];
+    return r;
+}
+#else
+// armv7 neon has no double lanes, the sum stays in scalar double
+#define dot_neon dot_scalar
+#endif
+
+static float fir_neon(const float *x, const float *h0, const float *h1, float fr, int taps) {
+    float32x4_t s = vdupq_n_f32(0.0f);
+    int k = 0;
+    for (; k + 4 <= taps; k += 4) {
+        const float32x4_t a = vld1q_f32(h0 + k);
+        const float32x4_t h = vmlaq_n_f32(a, vsubq_f32(vld1q_f32(h1 + k), a), fr);
+        s = vmlaq_f32(s, vld1q_f32(x + k), h);
+    }
+    float32x2_t p = vadd_f32(vget_low_f32(s), vget_high_f32(s));
+    p = vpadd_f32(p, p);
+    float r = vget_lane_f32(p, 0);
+    for (; k < taps; k++) r += x[k] * (h0[k] + fr * (h1[k] - h0[k]));
+    return r;
+}
+
+static const Kernels kernels_neon = {
+    "neon", peak_neon, gain_neon, accumulate_neon, dot_neon, fir_neon
+};
+#endif
+
+// --------------------------------------------------------------------------------
+
+// pick the best table the cpu supports
+static const Kernels& select_kernels() {
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return kernels_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return kernels_avx2;
+    if (__builtin_cpu_supports("sse2")) return kernels_sse2;
+#elif defined(KERNELS_NEON)
+    return kernels_neon;
+#endif
+    return kernels_scalar;
+}
+
+// the table in use, selected once on the first call
+inline const Kernels& kernels() {
+    static const Kernels& k = select_kernels();
+    return k;
+}
+
+} // end namespace profiler
+
+#endif  // #ifndef KERNELS_H
@@ -32,9 +32,58 @@ typedef enum
    STATE,
    METER,
    ERRORS,
+   RESUME,
+   PASSES,
+   REJECT,
+   EXPORT,
+   SPLIT,
+   NULLTEST,
+   NULLDEPTH,
+   ESR,
+   FITESR,
+   CALIBRATE,
+   TRIM,
+   HEADROOM,
+   SEQUENCE,
+   SETTLE,
+   TAKE,
+   FASTSTART,
+   FORMAT,
+   STIMULUS,
+   REFERENCE,
    CLIP,
 } PortIndex;
 
+// states of the null test, switched between the audio thread and the worker
+typedef enum
+{
+   NT_IDLE,
+   NT_OPEN,
+   NT_READY,
+   NT_CLOSE,
+   NT_FAIL,
+} NullState;
+
+// states of the capture queue, the worker load the queue, the audio thread run it
+typedef enum
+{
+   SQ_IDLE,
+   SQ_LOAD,
+   SQ_READY,
+   SQ_SETTLE,
+   SQ_RUN,
+   SQ_FAIL,
+} SeqState;
+
+// states of a stimulus change, the worker load the new stimulus, the audio thread swap it in
+typedef enum
+{
+   ST_IDLE,
+   ST_LOAD,
+   ST_READY,
+   ST_FREE,
+} StimState;
+
 
 #define fmax(x, y) (((x) > (y)) ? (x) : (y))
 #define fmin(x, y) (((x) < (y)) ? (x) : (y))
@@ -42,7 +91,15 @@ typedef enum
 #define always_inline inline __attribute__((always_inline))
 
 #define MAXRECSIZE 102400  //100kb
-#define MAXFILESIZE INT_MAX-MAXRECSIZE // 2147352576  //2147483648-MAXRECSIZE
+#define WAVLIMIT INT_MAX // bytes, above that a take is written as RF64, many readers take the wave sizes as signed
+#define SYNCBYTES 4194304  // fsync the recording after 4MB
+#define SYNCTIME 2         // or after 2 seconds, what ever comes first
+#define EXPORTFLOOR 1e-5   // -100dB, the stimulus counts as silent below
+#define SILENTMIN 24000    // frames, the shortest silent region of the stimulus noted, 0.5s at 48kHz
+#define SILENTBLOCK 4800   // frames, a take is checked for silence in blocks of 100ms
+#define SILENTFLOOR 1e-4   // -80dB, the target counts as near silent below
+#define CLIPLEVEL 0.989    // -0.1dBFS, the returning signal counts as clipped above
+#define TRIMLIMIT 15.85    // +-24dB, the maximal input trim
 
 
 #if defined(WIN32) || defined(_WIN32)
@@ -59,6 +116,18 @@ typedef enum
 // --------------------------------------------------------------------------------
 
 
+// the oscillator bank runs on a 16 bit phase, so one sine period of 65536 steps
+// replace the sin/cos calls per oscillator and sample, cos is the table a quarter ahead
+static const float *mtdm_table()
+{
+    static const std::vector<float> table = [] {
+        std::vector<float> t(65536);
+        for (int i = 0; i < 65536; i++) t[i] = sinf(2 * (float) M_PI * i / 65536.0);
+        return t;
+    }();
+    return &table[0];
+}
+
 struct MTDM * mtdm_new (double fsamp)
 {
     int   i;
@@ -86,6 +155,7 @@ struct MTDM * mtdm_new (double fsamp)
     retval->_freq [11].f = 3586;
     retval->_freq [12].f = 3841;
     retval->_wlp = 200.0f / fsamp;
+    retval->_sin = mtdm_table();
     for (i = 0, F = retval->_freq; i < 13; i++, F++) {
         F->p = 128;
         F->xa = F->ya = 0.0f;
@@ -114,7 +184,7 @@ void mtdm_clear (struct MTDM *self)
 int mtdm_process (struct MTDM *self, size_t len, const float *ip, float *op)
 {
     int    i;
-    float  vip, vop, a, c, s;
+    float  vip, vop, c, s;
     struct Freq   *F;
 
     while (len--)
@@ -123,10 +193,9 @@ int mtdm_process (struct MTDM *self, size_t len, const float *ip, float *op)
         vip = *ip++;
         for (i = 0, F = self->_freq; i < 13; i++, F++)
         {
-            a = 2 * (float) M_PI * (F->p & 65535) / 65536.0; 
+            c =  self->_sin[(F->p + 16384) & 65535];
+            s = -self->_sin[F->p & 65535];
             F->p += F->f;
-            c =  cosf (a); 
-            s = -sinf (a); 
             vop += (i ? 0.01f : 0.20f) * s;
             F->xa += s * vip;
             F->ya += c * vip;
@@ -189,7 +258,8 @@ void mtdm_invert (struct MTDM *self)
 // --------------------------------------------------------------------------------
 
 ProfilWorker::ProfilWorker()
-    : _execute(false) {
+    : _execute(false),
+      _pending(false) {
 }
 
 ProfilWorker::~ProfilWorker() {
@@ -206,6 +276,11 @@ void ProfilWorker::stop() {
     }
 }
 
+// block until the worker finished the current job
+void ProfilWorker::sync() {
+    std::lock_guard<std::mutex> lk(m);
+}
+
 void ProfilWorker::start(Profil *pt) {
     if( _execute.load(std::memory_order_acquire) ) {
         stop();
@@ -215,8 +290,13 @@ void ProfilWorker::start(Profil *pt) {
         while (_execute.load(std::memory_order_acquire)) {
             std::unique_lock<std::mutex> lk(m);
             // pt->busy.store(false, std::memory_order_release);
-            // wait for signal from dsp that work is to do
-            cv.wait(lk);
+            // wait for signal from dsp that work is to do, a signal send while we were busy
+            // is kept in _pending. The dsp can't take the lock, so look again after a timeout.
+            if (!cv.wait_for(lk, std::chrono::milliseconds(100), [this]() {
+                    return _pending.load(std::memory_order_acquire) ||
+                           !_execute.load(std::memory_order_acquire); }))
+                continue;
+            _pending.store(false, std::memory_order_release);
             //do work
             if (_execute.load(std::memory_order_acquire)) {
                 pt->run_thread(pt);
@@ -226,6 +306,12 @@ void ProfilWorker::start(Profil *pt) {
     });
 }
 
+// signal the worker that work is to do, called from the dsp
+void ProfilWorker::notify() {
+    _pending.store(true, std::memory_order_release);
+    cv.notify_one();
+}
+
 bool ProfilWorker::is_running() const noexcept {
     return ( _execute.load(std::memory_order_acquire) && 
              _thd.joinable() );
@@ -233,6 +319,102 @@ bool ProfilWorker::is_running() const noexcept {
 
 // --------------------------------------------------------------------------------
 
+// by default one core stay free for the audio thread and one for the calling worker
+ProfilPool::ProfilPool()
+    : _job(NULL),
+      _tasks(0),
+      _next(0),
+      _left(0),
+      _busy(0),
+      _gen(0),
+      _threads(fmax(0, int(std::thread::hardware_concurrency()) - 2)),
+      _stop(false) {
+}
+
+ProfilPool::~ProfilPool() {
+    stop();
+}
+
+void ProfilPool::stop() {
+    {
+        std::lock_guard<std::mutex> lk(m);
+        _stop = true;
+    }
+    cv.notify_all();
+    for (size_t i = 0; i < _thds.size(); i++) _thds[i].join();
+    _thds.clear();
+    _stop = false;
+}
+
+// change the number of helper threads, they are started again on the next stage
+void ProfilPool::resize(int threads) {
+    std::lock_guard<std::mutex> st(stage);
+    stop();
+    _threads = fmax(0, threads);
+}
+
+void ProfilPool::loop() {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lk(m);
+    while (!_stop) {
+        cv.wait(lk, [this, &seen]() { return _stop || (_job && _gen != seen); });
+        if (_stop) break;
+        seen = _gen;
+        const std::function<void(int)> *f = _job;
+        const int tasks = _tasks;
+        _busy++;
+        lk.unlock();
+        const int finished = drain(*f, tasks);
+        lk.lock();
+        _busy--;
+        _left -= finished;
+        if (!_left && !_busy) done.notify_all();
+    }
+}
+
+// pick up tasks of the running stage until none is left
+int ProfilPool::drain(const std::function<void(int)>& f, int tasks) {
+    int finished = 0;
+    int i;
+    while ((i = _next.fetch_add(1, std::memory_order_relaxed)) < tasks) {
+        f(i);
+        finished++;
+    }
+    return finished;
+}
+
+// run f(0) .. f(tasks - 1) and return when all are done, the order isn't defined
+void ProfilPool::parallel(int tasks, const std::function<void(int)>& f) {
+    std::unique_lock<std::mutex> st(stage, std::try_to_lock);
+    if (!st.owns_lock() || tasks < 2 || !_threads) {
+        for (int i = 0; i < tasks; i++) f(i);
+        return;
+    }
+    std::unique_lock<std::mutex> lk(m);
+    if (_thds.empty()) {
+        for (int i = 0; i < _threads; i++) _thds.push_back(std::thread(&ProfilPool::loop, this));
+    }
+    _job = &f;
+    _tasks = tasks;
+    _next.store(0, std::memory_order_relaxed);
+    _left = tasks;
+    _gen++;
+    lk.unlock();
+    cv.notify_all();
+    const int finished = drain(f, tasks);
+    lk.lock();
+    _left -= finished;
+    done.wait(lk, [this]() { return !_left && !_busy; });
+    _job = NULL;
+}
+
+static ProfilPool& pool() {
+    static ProfilPool p;
+    return p;
+}
+
+// --------------------------------------------------------------------------------
+
 template <class T>
 inline std::string to_string(const T& t) {
     std::stringstream ss;
@@ -240,23 +422,109 @@ inline std::string to_string(const T& t) {
     return ss.str();
 }
 
+// guard the capture index against concurrent instances
+static std::mutex indexmutex;
+// the highest capture number taken by any instance in this process
+static int usedindex = -1;
+
 // --------------------------------------------------------------------------------
 
 Profil::Profil(int channel_, std::function<void(const uint32_t , float) > setOutputParameterValue_,
-                             std::function<void(const uint32_t , float) > requestParameterValueChange_)
+                             std::function<void(const uint32_t , float) > requestParameterValueChange_,
+                             std::function<bool(const uint32_t, const uint8_t*, const uint32_t) > writeMidiEvent_)
     : recfile(NULL),
       playfile(NULL),
+      nullsf(NULL),
+      reffile(NULL),
+      journal(NULL),
       channel(channel_),
+      nextindex(0),
+      capindex(0),
+      caplatency(0),
+      capfast(false),
+      flacout(false),
+      rf64out(false),
+      silentout(false),
+      refmode(0),
+      reflatency(-1),
+      refcorrected(false),
+      blocksize(0),
+      knownrt(0),
+      confirmedrt(0),
+      confirmederr(0.0),
+      stimulushash(0),
+      resumeframes(0),
+      resumeoffset(0),
+      resumeindex(0),
+      resumepeak(0.1),
+      resumeinpeak(0.1),
+      stitchcorr(0.0),
+      npasses(1),
+      pass(0),
+      passpos(0),
+      passcount(0),
+      accepted(0),
+      avgbuf(NULL),
+      passbuf(NULL),
+      driftppm(0.0),
+      driftfixed(false),
+      chunkwake(false),
+      nullstate(NT_IDLE),
+      nullwake(false),
+      nullwrite(0),
+      nullread(0),
+      nullring(NULL),
+      nullgain(1.0),
+      nullarmed(true),
+      nullrun(false),
+      fitbuf(NULL),
+      fitwin(NULL),
+      fitspec(NULL),
+      fitacc(NULL),
+      fitfill(0),
+      fitpos(-1),
+      fitesr(-1.0),
+      calpos(-1),
+      callen(0),
+      calstart(0),
+      stimpeak(0.0),
+      stimpeakpos(0),
+      silentcur(0),
+      tapemap(0),
+      fstimulus(0.0),
+      stimindex(0),
+      stimwant(0),
+      stimstate(ST_IDLE),
+      stimwake(false),
+      intrim(1.0),
+      resumetrim(1.0),
+      headroom(0.0),
+      calibrated(false),
+      clipped(false),
+      wavefill(0),
+      seqstate(SQ_IDLE),
+      seqwake(false),
+      flushing(false),
+      seqcur(-1),
+      seqtake(0),
+      seqwait(0),
+      seqarmed(true),
+      seqopen(-1),
+      seqqueued(false),
       fRec0(0),
       fRec1(0),
+      fRef0(0),
+      fRef1(0),
       tape(fRec0),
+      reftape(fRef0),
       tape1(NULL),
       keep_stream(false),
       mem_allocated(false),
       err(false),
       time_match(false),
       setOutputParameterValue(setOutputParameterValue_),
-      requestParameterValueChange(requestParameterValueChange_) {
+      requestParameterValueChange(requestParameterValueChange_),
+      writeMidiEvent(writeMidiEvent_) {
       worker.start(this);
 }
 
@@ -303,9 +571,21 @@ std::string get_profile_library_path() {
 }
 #endif
 
+// create a directory when it didn't exist yet
+static void make_dir(const std::string& path) {
+    struct stat sb;
+    if (!(stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode))) {
+       #ifdef _WIN32
+        mkdir(path.c_str());
+       #else
+        mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+       #endif
+    }
+}
+
 // get the path were to save the recording and the input file
 inline std::string Profil::get_path() {
-    struct stat sb;
+    if (!profilepath.empty()) return profilepath;
     std::string pPath;
 
 #ifndef  __MOD_DEVICES__
@@ -336,29 +616,168 @@ inline std::string Profil::get_path() {
     pPath += PATH_SEPARATOR "Audio Recordings" PATH_SEPARATOR "profiles" PATH_SEPARATOR;
 #endif // __MOD_DEVICES__
 
-    if (!(stat(pPath.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode))) {
-       #ifdef _WIN32
-        mkdir(pPath.c_str());
-       #else
-        mkdir(pPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-       #endif
-    }
-
+    make_dir(pPath);
+    profilepath = pPath;
     return pPath;
 }
 
-// get the recording path and filename
+// get the recording path and filename, the next free number comes from the capture index,
+// so usually only one stat() is needed. Files created outside the index get skipped.
+// A take from the capture queue carries its parameter values in the name.
+// The target format is latched here, so it stays the same for the whole take.
 inline std::string Profil::get_ffilename() {
     struct stat buffer;
-    std::string name = "target.wav";
-    int i = 1;
-    while (stat ((get_path() + name).c_str(), &buffer) == 0) {
-        if (i > 1) name.erase(name.begin()+6, name.end()-4);
-        name.insert(6, "_" + to_string(i)); 
-        i+=1;
+    const std::string path = get_path();
+    std::string name;
+    sequence_open();
+    flacout = fformat > 0.5f;
+    do {
+        capindex = fmax(nextindex, usedindex + 1);
+        nextindex = capindex + 1;
+        name = (capindex ? "target_" + to_string(capindex) : "target") + seqname;
+    } while (stat ((path + name + ".wav").c_str(), &buffer) == 0 ||
+             stat ((path + name + ".flac").c_str(), &buffer) == 0);
+    name += flacout ? ".flac" : ".wav";
+    usedindex = capindex;
+
+    return path + name;
+}
+
+// a string as quoted json, names could hold quotes, backslashes or control characters
+static std::string json_string(const std::string& s) {
+    std::string r = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        const unsigned char ch = s[i];
+        if (ch == '"' || ch == '\\') {
+            r += '\\';
+            r += ch;
+        } else if (ch < 0x20) {
+            char b[8];
+            snprintf(b, sizeof(b), "\\u%04x", ch);
+            r += b;
+        } else {
+            r += ch;
+        }
     }
+    return r + "\"";
+}
 
-    return get_path() + name;
+// read back a json string written by json_string(), p points behind the opening quote
+static std::string json_unquote(const std::string& line, size_t p) {
+    std::string r;
+    for (; p < line.size() && line[p] != '"'; p++) {
+        if (line[p] == '\\' && p + 1 < line.size()) {
+            if (line[++p] == 'u') {
+                r += char(strtol(line.substr(p + 1, 4).c_str(), NULL, 16));
+                p += 4;
+                continue;
+            }
+        }
+        r += line[p];
+    }
+    return r;
+}
+
+// read the capture index once on activation to find the next free target number,
+// the last listed capture is the one the null test compares against
+void Profil::load_index() {
+    nextindex = 0;
+    nullfile.clear();
+    std::ifstream is(get_path() + "captures.jsonl");
+    std::string line;
+    while (std::getline(is, line)) {
+        size_t p = line.find("\"index\":");
+        if (p == std::string::npos) continue;
+        int i = atoi(line.c_str() + p + 8);
+        if (i >= nextindex) nextindex = i + 1;
+        p = line.find("\"file\":\"");
+        if (p == std::string::npos) continue;
+        nullfile = get_path() + json_unquote(line, p + 8);
+        nullgain = 1.0;
+        p = line.find("\"nf\":");
+        if (p != std::string::npos) {
+            std::istringstream ss(line.substr(p + 5));
+            ss.imbue(std::locale::classic());
+            float f = 1.0;
+            if ((ss >> f) && f > 0.0 && std::fabs(f - 1.0) > 0.01) nullgain = 1.0 / f;
+        }
+        p = line.find("\"trim\":");
+        if (p != std::string::npos) {
+            std::istringstream ss(line.substr(p + 7));
+            ss.imbue(std::locale::classic());
+            float f = 1.0;
+            if ((ss >> f) && f > 0.0) nullgain /= f;
+        }
+    }
+}
+
+// append the metadata of a finished capture as one json line to the capture index
+void Profil::write_index() {
+    const std::string path = get_path();
+    std::ostringstream ss;
+    ss.imbue(std::locale::classic());
+    ss << "{\"index\":" << capindex
+       << ",\"file\":" << json_string(outputfile.substr(path.size()))
+       << ",\"stimulus\":" << json_string(inputfile.substr(inputfile.find_last_of(PATH_SEPARATOR) + 1))
+       << ",\"stimulus_hash\":\"" << std::hex << std::setw(16) << std::setfill('0') << stimulushash << std::dec << "\""
+       << ",\"samplerate\":" << fSamplingFreq
+       << ",\"frames\":" << filesize / channel
+       << ",\"duration\":" << float(filesize / channel) / float(fSamplingFreq)
+       << ",\"latency\":" << caplatency
+       << ",\"input_peak\":" << fConst2
+       << ",\"target_peak\":" << fConst1
+       << ",\"nf\":" << nf;
+    if (npasses > 1) {
+        ss << ",\"passes\":" << npasses << ",\"passes_used\":" << accepted << ",\"pass_corr\":[";
+        for (int i = 0; i < passcount; i++) ss << (i ? "," : "") << passcorr[i];
+        ss << "]";
+    }
+    ss << ",\"drift_ppm\":" << driftppm
+       << ",\"drift_compensated\":" << (driftfixed ? "true" : "false");
+    ss << ",\"dropouts\":" << dropouts.size();
+    if (!exportdir.empty())
+        ss << ",\"export\":" << json_string(exportdir.substr(path.size()));
+    if (fitesr >= 0.0)
+        ss << ",\"linear_esr\":" << fitesr;
+    if (capfast)
+        ss << ",\"fast_start\":true";
+    if (overruns)
+        ss << ",\"overruns\":" << overruns;
+    if (rf64out)
+        ss << ",\"rf64\":true";
+    if (skipped)
+        ss << ",\"silence_skipped\":" << skipped / channel;
+    if (reflatency >= 0)
+        ss << ",\"reference_latency\":" << reflatency;
+    if (refcorrected)
+        ss << ",\"reference_corrected\":true";
+    else if (!refname.empty())
+        ss << ",\"reference\":" << json_string(refname.substr(path.size()));
+    if (intrim != 1.0f)
+        ss << ",\"trim\":" << intrim;
+    if (calibrated)
+        ss << ",\"headroom\":" << headroom;
+    if (seqopen >= 0 && seqqueued)
+        ss << ",\"sequence_take\":" << seqopen + 1;
+    if (seqopen >= 0)
+        ss << ",\"params\":{" << seqparams << "}";
+    if (resumeoffset)
+        ss << ",\"resumed_at\":" << resumeoffset
+           << ",\"stitch_corr\":" << stitchcorr;
+    ss << "}\n";
+    std::ofstream os(path + "captures.jsonl", std::ios::app);
+    os << ss.str();
+}
+
+// simple FNV-1a hash over the stimulus samples, stored with each capture
+static uint64_t hash_stimulus(const float *buf, int64_t lsize) {
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *b = reinterpret_cast<const unsigned char*>(buf);
+    for (size_t i = 0; i < size_t(lsize) * sizeof(float); i++) {
+        h ^= b[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
 }
 
 // check if input.wav is in path, otherwise copy it over and return path + filename
@@ -375,10 +794,32 @@ inline std::string Profil::get_ifilename() {
     return oname;
 }
 
+// decode a sound file into a new buffer, returns NULL when it couldn't be read
+static float *read_sound(const std::string& fname, int64_t *samples, int *channels, int *rate) {
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    SNDFILE *sf = sf_open(fname.c_str(), SFM_READ, &sfinfo);
+    if (!sf) return NULL;
+    float *buf = NULL;
+    try {
+        buf = new float[sfinfo.frames * sfinfo.channels]{};
+    } catch(...) {
+        sf_close(sf);
+        return NULL;
+    }
+    *samples = sf_read_float(sf, buf, sfinfo.frames * sfinfo.channels);
+    *channels = sfinfo.channels;
+    *rate = sfinfo.samplerate;
+    sf_close(sf);
+    return buf;
+}
+
 // convert included input.flac to wav file format and save it to path
 inline void  Profil::convert_to_wave(std::string fname, std::string oname) {
-    if (tape1) { delete[] tape1; tape1 = 0; }
-    int lsize = load_from_wave(fname); // load flac file
+    int64_t lsize = 0;
+    int c = 0, r = 0;
+    float *buf = read_sound(fname, &lsize, &c, &r); // load flac file
+    if (!buf) return;
 
     SF_INFO sfinfo ;
     sfinfo.channels = channel;
@@ -386,36 +827,243 @@ inline void  Profil::convert_to_wave(std::string fname, std::string oname) {
     sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_24;
     SNDFILE * sf = sf_open(oname.c_str(), SFM_WRITE, &sfinfo);
     if (sf) {
-        save_to_wave(sf, tape1, lsize);
+        sf_command(sf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+        save_to_wave(sf, buf, lsize);
         sf_close(sf);
     }
-    if (tape1) { delete[] tape1; tape1 = 0; }    
+    delete[] buf;
 }
 
+// the stimulus library, the sound files in the "stimuli" folder sorted by name.
+// Index 0 is always input.wav, the library entries follow from 1 on.
+std::vector<std::string> Profil::stimulus_list() {
+    static const char *ext[] = { ".wav", ".flac", ".ogg", ".aif", ".aiff", ".w64", ".rf64", ".caf" };
+    std::vector<std::string> lib;
+    DIR *dir = opendir((get_path() + "stimuli").c_str());
+    if (!dir) return lib;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string name = ent->d_name;
+        size_t p = name.find_last_of('.');
+        if (name[0] == '.' || p == std::string::npos) continue;
+        std::string e = name.substr(p);
+        std::transform(e.begin(), e.end(), e.begin(), ::tolower);
+        for (size_t i = 0; i < sizeof(ext) / sizeof(ext[0]); i++) {
+            if (e == ext[i]) {
+                lib.push_back(name);
+                break;
+            }
+        }
+    }
+    closedir(dir);
+    std::sort(lib.begin(), lib.end());
+    return lib;
+}
 
-// load wav file into buffer
-inline int Profil::load_from_wave(std::string fname) {
-    SF_INFO sfinfo;
-    int f,c;
-    int fSize = 0;
-    sfinfo.format = 0;
-    SNDFILE *sf = sf_open(fname.c_str(),SFM_READ,&sfinfo);
-    if (sf ) {
-        f = sfinfo.frames;
-        c = sfinfo.channels;
-        inputsize = f*c;
+// the file of a library entry, a index beyond the library falls back to input.wav
+std::string Profil::stimulus_file(int index) {
+    if (index > 0) {
+        std::vector<std::string> lib = stimulus_list();
+        if (index <= int(lib.size())) return get_path() + "stimuli" PATH_SEPARATOR + lib[index - 1];
+    }
+    return get_ifilename();
+}
 
-        try {
-            tape1 = new float[inputsize]{};
-        } catch(...) {
-            err = true;
-            return 0;
+// the cache of a stimulus is named by the hash of its path
+std::string Profil::stimulus_cache(const std::string& fname) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < fname.size(); i++) {
+        h ^= (unsigned char)fname[i];
+        h *= 1099511628211ULL;
+    }
+    std::ostringstream ss;
+    ss << get_path() << "stimuli" PATH_SEPARATOR ".cache" PATH_SEPARATOR
+       << std::hex << std::setw(16) << std::setfill('0') << h << ".f32";
+    return ss.str();
+}
+
+// note the regions where the stimulus stays silent for at least SILENTMIN frames
+static void find_silence(const float *buf, int64_t n, std::vector<SilentRun>& runs) {
+    runs.clear();
+    int64_t start = -1;
+    for (int64_t i = 0; i <= n; i++) {
+        if (i < n && std::fabs(buf[i]) < EXPORTFLOOR) {
+            if (start < 0) start = i;
+        } else if (start >= 0) {
+            if (i - start >= SILENTMIN) {
+                SilentRun r = { start, i - start };
+                runs.push_back(r);
+            }
+            start = -1;
         }
+    }
+}
 
-        fSize = sf_read_float(sf, tape1, inputsize);
+// map a cached stimulus, fails when the cache is missing, of a older version or
+// when the source file changed since it was decoded
+bool Profil::map_stimulus(const std::string& cname, const struct stat& sb, Stimulus& s) {
+    FILE *fp = fopen(cname.c_str(), "rb");
+    if (!fp) return false;
+    StimCacheHeader h;
+    struct stat cb;
+    bool valid = fread(&h, sizeof(h), 1, fp) == 1 && !memcmp(h.magic, "NRSTIM", 6) &&
+                 h.version == STIMCACHE && h.srcsize == int64_t(sb.st_size) &&
+                 h.srcmtime == int64_t(sb.st_mtime) && fstat(fileno(fp), &cb) == 0 &&
+                 int64_t(cb.st_size) == int64_t(sizeof(h) + h.samples * sizeof(float) + h.runs * sizeof(SilentRun));
+    if (!valid || h.samples <= 0 || h.runs < 0) {
+        fclose(fp);
+        return false;
+    }
+    const size_t bytes = sizeof(h) + h.samples * sizeof(float) + h.runs * sizeof(SilentRun);
+#ifndef _WIN32
+    // populate the pages now, the audio thread shouldn't fault them in
+    int flags = MAP_PRIVATE;
+   #ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+   #endif
+    void *base = mmap(NULL, bytes, PROT_READ, flags, fileno(fp), 0);
+    fclose(fp);
+    if (base == MAP_FAILED) return false;
+    s.data = reinterpret_cast<float*>(static_cast<char*>(base) + sizeof(h));
+    s.mapped = bytes;
+    s.silence.resize(h.runs);
+    if (h.runs) memcpy(&s.silence[0], s.data + h.samples, h.runs * sizeof(SilentRun));
+#else
+    try {
+        s.data = new float[h.samples];
+    } catch(...) {
+        fclose(fp);
+        return false;
+    }
+    s.silence.resize(h.runs);
+    if (fread(s.data, sizeof(float), h.samples, fp) != size_t(h.samples) ||
+        (h.runs && fread(&s.silence[0], sizeof(SilentRun), h.runs, fp) != size_t(h.runs))) {
+        delete[] s.data;
+        s.data = NULL;
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+    s.mapped = 0;
+#endif
+    s.size = h.samples;
+    s.hash = h.hash;
+    s.peak = h.peak;
+    s.peakpos = h.peakpos;
+    return true;
+}
+
+// load a stimulus from its cache, decode it into the cache first when needed.
+// When the cache couldn't be written the decoded samples are used from memory.
+bool Profil::load_stimulus(const std::string& fname, Stimulus& s) {
+    struct stat sb;
+    s.file = fname;
+    if (stat(fname.c_str(), &sb) != 0) return false;
+    const std::string cname = stimulus_cache(fname);
+    if (map_stimulus(cname, sb, s)) return true;
+    int64_t n = 0;
+    int c = 0, r = 0;
+    float *buf = read_sound(fname, &n, &c, &r);
+    if (!buf) return false;
+    StimCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "NRSTIM", 6);
+    h.version = STIMCACHE;
+    h.channels = c;
+    h.samplerate = r;
+    h.srcsize = sb.st_size;
+    h.srcmtime = sb.st_mtime;
+    h.samples = n;
+    h.hash = hash_stimulus(buf, n);
+    h.peak = kernels().peak(buf, n);
+    while (h.peakpos < n && std::fabs(buf[h.peakpos]) < h.peak) h.peakpos++;
+    std::vector<SilentRun> silence;
+    if (c == 1) find_silence(buf, n, silence);
+    h.runs = silence.size();
+    make_dir(get_path() + "stimuli");
+    make_dir(get_path() + "stimuli" PATH_SEPARATOR ".cache");
+    // write aside and rename, so a other instance never maps a half written cache
+    const std::string tname = cname + ".tmp";
+    FILE *fp = fopen(tname.c_str(), "wb");
+    if (fp) {
+        bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+                  fwrite(buf, sizeof(float), n, fp) == size_t(n) &&
+                  (silence.empty() || fwrite(&silence[0], sizeof(SilentRun), silence.size(), fp) == silence.size());
+        ok = fclose(fp) == 0 && ok;
+        if (!ok || std::rename(tname.c_str(), cname.c_str()) != 0) std::remove(tname.c_str());
+    }
+    if (map_stimulus(cname, sb, s)) {
+        delete[] buf;
+        return true;
+    }
+    s.data = buf;
+    s.size = n;
+    s.hash = h.hash;
+    s.peak = h.peak;
+    s.peakpos = h.peakpos;
+    s.mapped = 0;
+    s.silence.swap(silence);
+    return true;
+}
+
+// unmap or free a stimulus
+void Profil::free_stimulus(Stimulus& s) {
+    if (s.data) {
+#ifndef _WIN32
+        if (s.mapped) munmap(reinterpret_cast<char*>(s.data) - sizeof(StimCacheHeader), s.mapped);
+        else
+#endif
+        delete[] s.data;
+    }
+    s = Stimulus();
+}
+
+// exchange the playing stimulus with s, only pointers and sizes move
+void Profil::swap_stimulus(Stimulus& s) {
+    std::swap(tape1, s.data);
+    std::swap(inputsize, s.size);
+    std::swap(stimulushash, s.hash);
+    std::swap(stimpeak, s.peak);
+    std::swap(stimpeakpos, s.peakpos);
+    std::swap(tapemap, s.mapped);
+    stimsilence.swap(s.silence);
+    inputfile.swap(s.file);
+}
+
+// a changed stimulus is loaded by the worker and swapped in while no capture, null test
+// or queue runs. Returns true while the new stimulus loads, a capture waits for it.
+inline bool Profil::stimulus_control(bool busy) {
+    const int st = stimstate.load(std::memory_order_acquire);
+    if (busy) return false;
+    if (st == ST_READY) {
+        swap_stimulus(stimnext);
+        stimindex = stimwant;
+        calibrate_init();
+        // the worker free the old one
+        stimstate.store(ST_FREE, std::memory_order_release);
+        stimwake.store(true, std::memory_order_release);
+        worker.notify();
+    } else if (st == ST_IDLE && stimulusfile.empty() && int(fstimulus) != stimindex) {
+        stimwant = int(fstimulus);
+        stimstate.store(ST_LOAD, std::memory_order_release);
+        stimwake.store(true, std::memory_order_release);
+        worker.notify();
+        return true;
+    }
+    return st == ST_LOAD;
+}
+
+// the worker side of a stimulus change
+void Profil::stimulus_stream() {
+    const int st = stimstate.load(std::memory_order_acquire);
+    if (st == ST_LOAD) {
+        // a missing stimulus is swapped in empty, the capture stops then with "input missing"
+        if (!load_stimulus(stimulus_file(stimwant), stimnext)) free_stimulus(stimnext);
+        stimstate.store(ST_READY, std::memory_order_release);
+    } else if (st == ST_FREE) {
+        free_stimulus(stimnext);
+        stimstate.store(ST_IDLE, std::memory_order_release);
     }
-    sf_close(sf);
-    return fSize;
 }
 
 // save the chunks to disk
@@ -423,30 +1071,520 @@ void Profil::disc_stream() {
     if (!worker.is_running()) {
         return;
     }
+    if (npasses > 1) {
+        average_stream();
+        return;
+    }
     if (!recfile) {
-        outputfile = get_ffilename();
-        recfile = open_stream(outputfile);
+        // serialise filename allocation between instances
+        std::lock_guard<std::mutex> lk(indexmutex);
+        if (resumeoffset) {
+            resume_stream();
+        } else {
+            outputfile = get_ffilename();
+            recfile = open_stream(outputfile);
+            if (refmode) open_reference();
+        }
+        // a FLAC encoder packs silence by itself, a take which may be resumed is kept frame exact
+        silentout = !resumeoffset && !flacout && !rf64out && fresume <= 0.5f && channel == 1 &&
+                    !stimsilence.empty();
+        silentcur = 0;
+        open_journal();
+        fit_reset();
     }
-    save_to_wave(recfile, tape, savesize);
+    fit_chunk(tape, savesize, filesize / channel);
+    fit_report();
+    if (silentout) save_active(tape, savesize, filesize / channel);
+    else save_to_wave(recfile, tape, savesize);
+    if (reffile) save_to_wave(reffile, reftape, savesize);
     filesize +=savesize;
-    if ((!keep_stream && recfile) || (filesize >MAXFILESIZE)) {
-        close_stream(&recfile);
-        filesize = 0;
-        if (!time_match) {
+    commit_journal();
+    if (!keep_stream && recfile) {
+        finish_stream();
+    }
+}
+
+// close the recording and note it in the capture index, or keep/remove a interrupted take
+void Profil::finish_stream() {
+    close_stream(&recfile);
+    close_stream(&reffile);
+    if (!time_match) {
+        // a FLAC stream can't be reopened for writing, so only wave takes could be resumed
+        if (fresume > 0.5f && filesize && seqopen < 0 && !flacout && !skipped && !clipped) {
+            // keep the interrupted take to resume it later
+            resumefile = outputfile;
+            resumeindex = capindex;
+            resumepeak = fConst1;
+            resumeinpeak = fConst2;
+            resumetrim = intrim;
+            resumeframes.store(filesize / channel, std::memory_order_release);
+        } else {
+            std::remove(outputfile.c_str());
+        }
+        // the reference isn't resumed
+        if (!refname.empty()) std::remove(refname.c_str());
+    } else {
+        if (post_process()) {
+            std::lock_guard<std::mutex> lk(indexmutex);
+            write_index();
+            post_event(EV_CAPTURE, capindex, nf, outputfile);
+            // the null test undo the normalisation and the input trim of the target
+            nullfile = outputfile;
+            nullgain = (std::fabs(nf - 1.0) > 0.01 ? 1.0 / nf : 1.0) / intrim;
+        } else {
             std::remove(outputfile.c_str());
+            if (!refname.empty()) std::remove(refname.c_str());
+        }
+        resumeframes.store(0, std::memory_order_release);
+        resumefile.clear();
+    }
+    close_journal();
+    refname.clear();
+    silentskip.clear();
+    silentout = false;
+    skipped = 0;
+    filesize = 0;
+}
+
+// samples per task of the parallel post processing stages
+#define POOLCHUNK 65536
+
+// sum a pass into the average arena
+static void accumulate(float *dst, const float *src, int n) {
+    pool().parallel((n + POOLCHUNK - 1) / POOLCHUNK, [=](int c) {
+        const int o = c * POOLCHUNK;
+        kernels().accumulate(dst + o, src + o, fmin(POOLCHUNK, n - o));
+    });
+}
+
+// scale a buffer by a constant gain
+static void apply_gain(float *buf, float gain, int n) {
+    pool().parallel((n + POOLCHUNK - 1) / POOLCHUNK, [=](int c) {
+        const int o = c * POOLCHUNK;
+        kernels().gain(buf + o, gain, fmin(POOLCHUNK, n - o));
+    });
+}
+
+// normalised correlation of a against b shifted by lag l, over the overlapping part
+static float lag_corr(const float *a, const float *b, int n, int l) {
+    const Kernels& k = kernels();
+    const int lo = fmax(0, -l);
+    const int len = fmin(n, n - l) - lo;
+    double xy = k.dot(a + lo, b + lo + l, len);
+    double xx = 1e-20 + k.dot(a + lo, a + lo, len);
+    double yy = 1e-20 + k.dot(b + lo + l, b + lo + l, len);
+    return xy / sqrt(xx * yy);
+}
+
+// normalised correlation of a pass against the running sum of the accepted passes,
+// searched over a few samples lag to catch passes which drifted away
+static float pass_check(const float *sum, const float *b, int n, int *lag) {
+    float c[17];
+    pool().parallel(17, [=, &c](int i) { c[i] = lag_corr(sum, b, n, i - 8); });
+    float best = 0.0;
+    *lag = 0;
+    for (int l = -8; l <= 8; l++) {
+        if (c[l + 8] > best) {
+            best = c[l + 8];
+            *lag = l;
         }
     }
+    return best;
+}
+
+// a pass is complete, check it against the others and add it to the average
+void Profil::finish_pass() {
+    int lag = 0;
+    float corr = accepted ? pass_check(avgbuf, passbuf, inputsize, &lag) : 1.0;
+    passcorr[passcount] = corr;
+    // exclude passes which drifted or didn't correlate with the others
+    if (!lag && corr > 0.8) {
+        accumulate(avgbuf, passbuf, inputsize);
+        accepted++;
+    } else {
+        passcorr[passcount] = -corr;
+    }
+    passcount++;
+    passpos = 0;
+}
+
+// collect the chunks of a multi pass take in memory and write only the averaged result
+void Profil::average_stream() {
+    if (!avgbuf) {
+        try {
+            avgbuf = new float[inputsize]{};
+            passbuf = new float[inputsize]{};
+        } catch(...) {
+            err = true;
+            npasses = 1;
+            return;
+        }
+        passpos = 0;
+        passcount = 0;
+        accepted = 0;
+        fit_reset();
+    }
+    // the linear model fit runs over the first pass only
+    if (!passcount) {
+        fit_chunk(tape, fmin(savesize, inputsize - passpos), passpos / channel);
+        fit_report();
+    }
+    for (int i = 0; i < savesize; i++) {
+        if (passcount >= npasses) break;
+        passbuf[passpos++] = tape[i];
+        if (passpos >= inputsize) finish_pass();
+    }
+    if (keep_stream) return;
+    if (time_match && accepted) {
+        apply_gain(avgbuf, 1.0 / accepted, inputsize);
+        {
+            std::lock_guard<std::mutex> lk(indexmutex);
+            outputfile = get_ffilename();
+            recfile = open_stream(outputfile);
+        }
+        save_to_wave(recfile, avgbuf, inputsize);
+        filesize = inputsize;
+        finish_stream();
+    }
+    delete[] avgbuf;
+    delete[] passbuf;
+    avgbuf = NULL;
+    passbuf = NULL;
+}
+
+// the journal hold the number of frames which are safe on disk,
+// so a truncated recording could be repaired after a crash.
+// It stays locked while the take is recorded, so other instances leave it alone.
+void Profil::open_journal() {
+    unsynced = 0;
+    synctime = std::chrono::steady_clock::now();
+    if (!recfile || flacout) return;
+    journalfile = outputfile + ".journal";
+#ifdef _WIN32
+    journal = _fsopen(journalfile.c_str(), "w", _SH_DENYRW);
+#else
+    // flock() is held per open file, so it works between instances in the same process as well.
+    // The journal is locked under a temporary name, a other instance never sees it unlocked.
+    const std::string tmpname = journalfile + ".new";
+    journal = fopen(tmpname.c_str(), "w");
+    if (journal && (flock(fileno(journal), LOCK_EX | LOCK_NB) != 0 ||
+                    std::rename(tmpname.c_str(), journalfile.c_str()) != 0)) {
+        fclose(journal);
+        journal = NULL;
+        std::remove(tmpname.c_str());
+    }
+#endif
+}
+
+// fsync the recording on a time or byte budget instead of per chunk
+// and note the committed frame count in the journal
+void Profil::commit_journal() {
+    if (!recfile) return;
+    unsynced += savesize * 3;
+    if (keep_stream && unsynced < SYNCBYTES &&
+        std::chrono::steady_clock::now() - synctime < std::chrono::seconds(SYNCTIME)) return;
+    sf_write_sync(recfile);
+    unsynced = 0;
+    synctime = std::chrono::steady_clock::now();
+    if (!journal) return;
+    rewind(journal);
+    // the trim is stored as float bits to stay independent of the locale
+    uint32_t trimbits = 0;
+    memcpy(&trimbits, &intrim, sizeof(trimbits));
+    fprintf(journal, "%12lli %i %i %016llx %08x\n", (long long)((filesize - skipped) / channel), channel, fSamplingFreq,
+                                                (unsigned long long)stimulushash, trimbits);
+    // the skipped silent regions, the frames on disk expand to the take with them
+    for (size_t i = 0; i < silentskip.size(); i++)
+        fprintf(journal, "%lli %lli\n", (long long)silentskip[i].start, (long long)silentskip[i].length);
+    fflush(journal);
+#ifdef _WIN32
+    _commit(_fileno(journal));
+#else
+    fsync(fileno(journal));
+#endif
+}
+
+// the recording is closed clean, so we didn't need the journal anymore
+void Profil::close_journal() {
+#ifdef _WIN32
+    if (journal) fclose(journal);
+    if (!journalfile.empty()) std::remove(journalfile.c_str());
+#else
+    // remove it while it's still locked
+    if (!journalfile.empty()) std::remove(journalfile.c_str());
+    if (journal) fclose(journal);
+#endif
+    journal = NULL;
+    journalfile.clear();
+}
+
+// read/write little endian 32 bit values in a wave header
+static uint32_t read_le32(const unsigned char *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static void write_le32(unsigned char *b, uint32_t v) {
+    b[0] = v & 0xff; b[1] = (v >> 8) & 0xff; b[2] = (v >> 16) & 0xff; b[3] = (v >> 24) & 0xff;
+}
+
+// the 64 bit sizes of the RF64 ds64 chunk
+static void write_le64(unsigned char *b, uint64_t v) {
+    write_le32(b, v & 0xffffffff);
+    write_le32(b + 4, v >> 32);
+}
+
+// expand the frames of a take, written with its silent regions skipped, in place to the
+// full length, buf must hold the full length. Returns the expanded length.
+static int expand_runs(float *buf, int n, const std::vector<SilentRun>& runs) {
+    int out = n;
+    for (size_t i = 0; i < runs.size(); i++) out += runs[i].length;
+    const int full = out;
+    int src = n;
+    for (size_t i = runs.size(); i-- > 0;) {
+        const int end = runs[i].start + runs[i].length;
+        const int len = out - end;
+        src -= len;
+        memmove(buf + end, buf + src, len * sizeof(float));
+        memset(buf + runs[i].start, 0, runs[i].length * sizeof(float));
+        out = runs[i].start;
+    }
+    return full;
+}
+
+// expand a take file, written with its silent regions skipped, to the full length.
+// The take is copied aside with the runs filled with silence and renamed.
+static bool expand_take(const std::string& fname, const std::vector<SilentRun>& runs) {
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    SNDFILE *in = sf_open(fname.c_str(), SFM_READ, &sfinfo);
+    if (!in) return false;
+    const std::string tname = fname + ".tmp";
+    SNDFILE *out = sf_open(tname.c_str(), SFM_WRITE, &sfinfo);
+    if (!out) {
+        sf_close(in);
+        return false;
+    }
+    std::vector<float> buf(POOLCHUNK * sfinfo.channels);
+    int64_t pos = 0;
+    bool ok = true;
+    for (size_t i = 0; i <= runs.size() && ok; i++) {
+        // the active frames up to the next run, or the rest after the last one
+        int64_t len = i < runs.size() ? runs[i].start - pos : INT64_MAX;
+        while (len > 0 && ok) {
+            sf_count_t r = sf_readf_float(in, &buf[0], fmin(len, POOLCHUNK));
+            if (r <= 0) break;
+            ok = sf_writef_float(out, &buf[0], r) == r;
+            len -= r;
+            pos += r;
+        }
+        if (i == runs.size()) break;
+        std::fill(buf.begin(), buf.end(), 0.0f);
+        for (len = runs[i].length; len > 0 && ok; len -= POOLCHUNK)
+            ok = sf_writef_float(out, &buf[0], fmin(len, POOLCHUNK)) == fmin(len, POOLCHUNK);
+        pos = runs[i].start + runs[i].length;
+    }
+    sf_close(in);
+    sf_close(out);
+    if (!ok || std::rename(tname.c_str(), fname.c_str()) != 0) {
+        std::remove(tname.c_str());
+        return false;
+    }
+    return true;
+}
+
+// patch the RIFF and data chunk size of a wave file to the given frame count
+// and cut off what was written after the last commit. A RF64 file keeps
+// 0xffffffff in the 32 bit fields, the real sizes go to the ds64 chunk.
+static bool repair_wave(std::string fname, int64_t frames) {
+    FILE *fp = fopen(fname.c_str(), "r+b");
+    if (!fp) return false;
+    unsigned char b[28];
+    bool ret = false;
+    off_t pos = 12;
+    off_t ds64 = 0;
+    uint32_t blockalign = 0;
+    if (fread(b, 1, 12, fp) == 12 && (!memcmp(b, "RIFF", 4) || !memcmp(b, "RF64", 4)) && !memcmp(b + 8, "WAVE", 4)) {
+        const bool rf64 = !memcmp(b, "RF64", 4);
+        while (fseeko(fp, pos, SEEK_SET) == 0 && fread(b, 1, 8, fp) == 8) {
+            uint32_t csize = read_le32(b + 4);
+            if (!memcmp(b, "ds64", 4)) {
+                ds64 = pos + 8;
+            } else if (!memcmp(b, "fmt ", 4)) {
+                unsigned char f[16];
+                if (fread(f, 1, 16, fp) != 16) break;
+                blockalign = f[12] | (f[13] << 8);
+            } else if (!memcmp(b, "data", 4)) {
+                if (!blockalign || (rf64 && !ds64)) break;
+                fseeko(fp, 0, SEEK_END);
+                off_t datastart = pos + 8;
+                int64_t avail = (ftello(fp) - datastart) / blockalign;
+                int64_t dsize = (frames < avail ? frames : avail) * blockalign;
+                off_t fsize = datastart + dsize + (dsize & 1);
+                if (rf64) {
+                    write_le64(b, fsize - 8);
+                    write_le64(b + 8, dsize);
+                    write_le64(b + 16, dsize / blockalign);
+                    fseeko(fp, ds64, SEEK_SET);
+                    fwrite(b, 1, 24, fp);
+                } else {
+                    write_le32(b, dsize);
+                    fseeko(fp, pos + 4, SEEK_SET);
+                    fwrite(b, 1, 4, fp);
+                    write_le32(b, fsize - 8);
+                    fseeko(fp, 4, SEEK_SET);
+                    fwrite(b, 1, 4, fp);
+                }
+                fflush(fp);
+               #ifndef _WIN32
+                if (ftruncate(fileno(fp), fsize) != 0) break;
+               #endif
+                ret = true;
+                break;
+            }
+            pos += 8 + csize + (csize & 1);
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+// a journal is stale when no capture holds its lock anymore, fp is the open journal
+static bool journal_stale(FILE *fp, const std::string& fname) {
+#ifdef _WIN32
+    // a journal in use is opened without sharing, so we couldn't have opened it
+    (void)fp;
+    (void)fname;
+    return true;
+#else
+    if (flock(fileno(fp), LOCK_EX | LOCK_NB) != 0) return false;
+    // the capture may have finished and removed it meanwhile
+    struct stat a, b;
+    return fstat(fileno(fp), &a) == 0 && stat(fname.c_str(), &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#endif
+}
+
+// on activation, look for journals left by a crashed capture and repair the recordings,
+// journals of takes which are still recorded by other instances are skipped
+void Profil::recover_captures() {
+    const std::string path = get_path();
+    DIR *dir = opendir(path.c_str());
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string name = ent->d_name;
+        if (name.size() <= 8 || name.compare(name.size() - 8, 8, ".journal") != 0) continue;
+        long long frames = 0;
+        unsigned long long hash = 0;
+        unsigned int trimbits = 0;
+        std::vector<SilentRun> runs;
+        FILE *fp = fopen((path + name).c_str(), "r");
+        if (!fp) continue;
+        if (!journal_stale(fp, path + name)) {
+            fclose(fp);
+            continue;
+        }
+        if (fscanf(fp, "%lli %*i %*i %llx %x", &frames, &hash, &trimbits) < 1) frames = 0;
+        long long start = 0, length = 0;
+        while (fscanf(fp, "%lli %lli", &start, &length) == 2) {
+            SilentRun r = { start, length };
+            runs.push_back(r);
+        }
+        std::string wname = name.substr(0, name.size() - 8);
+        bool repaired = repair_wave(path + wname, frames);
+        // a take written with skipped silence gets its full length back
+        if (repaired && !runs.empty()) {
+            repaired = expand_take(path + wname, runs);
+            for (size_t i = 0; i < runs.size(); i++) frames += runs[i].length;
+        }
+        // a repaired take for the current stimulus could be resumed
+        if (repaired && frames && hash == stimulushash) {
+            resumefile = path + wname;
+            size_t p = wname.find('_');
+            resumeindex = p == std::string::npos ? 0 : atoi(wname.c_str() + p + 1);
+            resumepeak = 0.1;
+            resumeinpeak = 0.1;
+            resumetrim = 1.0;
+            if (trimbits) memcpy(&resumetrim, &trimbits, sizeof(resumetrim));
+            resumeframes.store(frames, std::memory_order_release);
+        }
+        // keep the lock until the journal is gone, so only one instance repairs the take
+#ifdef _WIN32
+        fclose(fp);
+        std::remove((path + name).c_str());
+#else
+        std::remove((path + name).c_str());
+        fclose(fp);
+#endif
+    }
+    closedir(dir);
+}
+
+// normalised cross correlation between the end of the old take and the start of the resumed one,
+// returns the best correlation and the lag where it was found
+static float stitch_check(const float *a, const float *b, int n, int *lag) {
+    float best = 0.0;
+    *lag = 0;
+    for (int l = -16; l <= 16; l++) {
+        float c = lag_corr(a, b, n, l);
+        if (c > best) {
+            best = c;
+            *lag = l;
+        }
+    }
+    return best;
+}
+
+// reopen a interrupted recording, crossfade the overlap with the first chunk
+// of the resumed take and continue writing from there
+void Profil::resume_stream() {
+    outputfile = resumefile;
+    capindex = resumeindex;
+    flacout = false;
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    recfile = sf_open(outputfile.c_str(), SFM_RDWR, &sfinfo);
+    if (!recfile) return;
+    sf_command(recfile, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    rf64out = (sfinfo.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_RF64;
+    int ov = fmin((resumeframes - resumeoffset) * channel, savesize);
+    float *old = new float[ov]{};
+    sf_seek(recfile, resumeoffset, SEEK_SET | SFM_READ);
+    ov = sf_read_float(recfile, old, ov);
+    int lag = 0;
+    stitchcorr = stitch_check(old, tape, ov, &lag);
+    if (ov && (lag || stitchcorr < 0.5)) {
+        post_error(5.0);
+    }
+    for (int i = 0; i < ov; i++) {
+        float w = float(i) / float(ov);
+        tape[i] = old[i] * (1.0 - w) + tape[i] * w;
+    }
+    delete[] old;
+    sf_seek(recfile, resumeoffset, SEEK_SET | SFM_WRITE);
+    filesize = resumeoffset * channel;
 }
 
 // run the recording thread
 void Profil::run_thread(void *p) {
-    (reinterpret_cast<Profil *>(p))->disc_stream();
+    Profil *pt = reinterpret_cast<Profil *>(p);
+    if (pt->nullwake.exchange(false, std::memory_order_acq_rel)) pt->null_stream();
+    if (pt->seqwake.exchange(false, std::memory_order_acq_rel)) pt->sequence_stream();
+    if (pt->stimwake.exchange(false, std::memory_order_acq_rel)) pt->stimulus_stream();
+    if (pt->chunkwake.exchange(false, std::memory_order_acq_rel)) {
+        bool last = !pt->keep_stream;
+        pt->disc_stream();
+        // the take is on disk, the next take of the queue could start
+        if (last) pt->flushing.store(false, std::memory_order_release);
+    }
 }
 
 // clear all internal buffers on activation
 inline void Profil::clear_state_f() {
     for (int i=0; i<MAXRECSIZE; i++) fRec0[i] = 0;
     for (int i=0; i<MAXRECSIZE; i++) fRec1[i] = 0;
+    for (int i=0; i<MAXRECSIZE; i++) fRef0[i] = 0;
+    for (int i=0; i<MAXRECSIZE; i++) fRef1[i] = 0;
     for (int i=0; i<2; i++) fRecb0[i] = 0;
     for (int i=0; i<2; i++) iRecb1[i] = 0;
     for (int i=0; i<2; i++) fRecb2[i] = 0.0000003; // -130db
@@ -462,10 +1600,15 @@ void Profil::clear_state(Profil *p) {
 
 // init internal variables and the round trip mesuarment function
 inline void Profil::init(unsigned int samplingFreq) {
+    // keep a latency confirmed at the old samplerate
+    latency_merge();
     fSamplingFreq = samplingFreq;
     IOTA = 0;
     IOTAP = 0;
     inputsize = 0;
+    filesize = 0;
+    skipped = 0;
+    unsynced = 0;
     latency = 0;
     roundtrip = 0;
     measure = 0;
@@ -473,17 +1616,27 @@ inline void Profil::init(unsigned int samplingFreq) {
     fConst1 = 0.1;
     fConst2 = 0.1;
     nf = 1.0;
-    iRef = 0;
-    iRefSet = 0;
-    fRef = 0.0000003;
     errors = 0.0;
     reset_errors = 0;
+    overruns = 0;
+    fresume = 0.0;
+    fpasses = 1.0;
+    freject = 0.0;
+    fexport = 0.0;
+    fsplit = 0.0;
+    fnull = 0.0;
+    fcalib = 0.0;
+    fseq = 0.0;
+    fsettle = 2.0;
+    ffast = 0.0;
+    fformat = 0.0;
+    fstimulus = 0.0;
+    freference = 0.0;
     fConst0 = (1.0f / float(fmin(192000, fmax(1, fSamplingFreq))));
     mtdm = mtdm_new(fSamplingFreq);
     if (fSamplingFreq != 48000) {
         err = true;
-        errors = 3.0;
-        setOutputParameterValue(ERRORS, errors);
+        post_error(3.0);
     }
 }
 
@@ -493,63 +1646,1257 @@ void Profil::set_samplerate(unsigned int samplingFreq, Profil *p) {
 }
 
 // save a chunk of data to a wave file
-inline void Profil::save_to_wave(SNDFILE * sf, float *tape, int lSize) {
+inline void Profil::save_to_wave(SNDFILE * sf, float *tape, int64_t lSize) {
     if (sf) {
         sf_write_float(sf,tape, lSize);
-        sf_write_sync(sf);
     } else {
         err = true;
     }
 }
 
-// open a wave file to write data in
+// save a chunk of the take starting at frame pos. In the silent regions of the stimulus,
+// blocks where the device is near silent as well are skipped and noted as a run of
+// silence, only the active regions go to disk at full resolution.
+void Profil::save_active(float *buf, int n, int64_t pos) {
+    const Kernels& k = kernels();
+    int i = 0;
+    while (i < n) {
+        // the next silent region which ends after this position
+        while (silentcur < stimsilence.size() &&
+               stimsilence[silentcur].start + stimsilence[silentcur].length <= pos + i) silentcur++;
+        if (silentcur == stimsilence.size() || stimsilence[silentcur].start > pos + i) {
+            int len = n - i;
+            if (silentcur < stimsilence.size()) len = fmin(len, stimsilence[silentcur].start - pos - i);
+            save_to_wave(recfile, buf + i, len);
+            i += len;
+            continue;
+        }
+        const SilentRun& r = stimsilence[silentcur];
+        const int len = fmin(fmin(n - i, r.start + r.length - pos - i), SILENTBLOCK);
+        if (k.peak(buf + i, len) >= SILENTFLOOR) {
+            save_to_wave(recfile, buf + i, len);
+        } else if (!silentskip.empty() && silentskip.back().start + silentskip.back().length == pos + i) {
+            silentskip.back().length += len;
+            skipped += len;
+        } else {
+            SilentRun s = { pos + i, len };
+            silentskip.push_back(s);
+            skipped += len;
+        }
+        i += len;
+    }
+}
+
+// open a wave or FLAC file to write data in, libsndfile encode the FLAC frames
+// while we write, so the worker thread stream the compressed take straight to disk.
+// The length of a take is known from the stimulus, so a take which would pass the
+// wave size limit is written as RF64 right from the start.
 SNDFILE *Profil::open_stream(std::string fname) {
     SF_INFO sfinfo ;
     sfinfo.channels = channel;
     sfinfo.samplerate = fSamplingFreq;
-    sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_24;
+    rf64out = !flacout && (inputsize + MAXRECSIZE) * 3 > WAVLIMIT;
+    sfinfo.format = (flacout ? SF_FORMAT_FLAC : rf64out ? SF_FORMAT_RF64 : SF_FORMAT_WAV) | SF_FORMAT_PCM_24;
     
     SNDFILE * sf = sf_open(fname.c_str(), SFM_WRITE, &sfinfo);
-    if (sf) return sf;
-    else return NULL;
+    if (!sf) return NULL;
+    // clip samples above full scale, libsndfile would wrap them around in a integer format
+    sf_command(sf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    if (flacout) {
+        // a low compression level keep the encoder cheap on small ARM boxes
+        double level = 0.2;
+        sf_command(sf, SFC_SET_COMPRESSION_LEVEL, &level, sizeof(level));
+    }
+    return sf;
 }
 
-// crude normalisation function, barly used
-void Profil::normalize() {
-    if (tape1) { delete[] tape1; tape1 = 0; }
-    int n = load_from_wave(outputfile);
-    for (int i = 0;i<n;i++) {
-        tape1[i] *= nf;
+// crude normalisation function, barly used. The regions skipped as silence are left out.
+void Profil::normalize(float *buf, int n) {
+    int64_t pos = 0;
+    for (size_t i = 0; i < silentskip.size(); i++) {
+        apply_gain(buf + pos, nf, silentskip[i].start - pos);
+        pos = silentskip[i].start + silentskip[i].length;
     }
-    SNDFILE * sf = open_stream(outputfile);
-    if (sf) {
-        save_to_wave(sf, tape1, n);
+    apply_gain(buf + pos, nf, n - pos);
+}
+
+// windowed cross correlation of the target against the stimulus around a expected lag,
+// returns the sub-sample lag of the peak or a value above MAXLAG when no peak was found
+#define DRIFTWIN 16384
+#define DRIFTSEARCH 64
+#define MAXLAG 1e9
+
+static double window_lag(const float *stim, const float *tgt, int nt, int pos, int center) {
+    const Kernels& k = kernels();
+    double c[2 * DRIFTSEARCH + 1];
+    double xx = 1e-20 + k.dot(stim + pos, stim + pos, DRIFTWIN);
+    int best = -1;
+    double bestc = 0.0;
+    for (int l = -DRIFTSEARCH; l <= DRIFTSEARCH; l++) {
+        int o = pos + center + l;
+        if (o < 0 || o + DRIFTWIN > nt) {
+            c[l + DRIFTSEARCH] = 0.0;
+            continue;
+        }
+        double xy = k.dot(stim + pos, tgt + o, DRIFTWIN);
+        c[l + DRIFTSEARCH] = xy;
+        if (std::fabs(xy) > bestc) {
+            bestc = std::fabs(xy);
+            best = l + DRIFTSEARCH;
+        }
+    }
+    if (best < 1 || best >= 2 * DRIFTSEARCH) return MAXLAG + 1;
+    int o = pos + center + best - DRIFTSEARCH;
+    double yy = 1e-20 + k.dot(tgt + o, tgt + o, DRIFTWIN);
+    // no usable peak in this window
+    if (bestc / sqrt(xx * yy) < 0.3) return MAXLAG + 1;
+    // parabolic interpolation of the peak
+    double a = std::fabs(c[best - 1]), b = std::fabs(c[best]), d = std::fabs(c[best + 1]);
+    double den = a - 2.0 * b + d;
+    double frac = den != 0.0 ? 0.5 * (a - d) / den : 0.0;
+    return center + best - DRIFTSEARCH + frac;
+}
+
+// band limited interpolation kernel, a blackman windowed sinc in 256 phases
+#define SINCTAPS 32
+#define SINCPHASES 256
+
+static void make_sinc(float *table) {
+    const double fc = 0.97;
+    for (int p = 0; p <= SINCPHASES; p++) {
+        double frac = double(p) / SINCPHASES;
+        for (int k = 0; k < SINCTAPS; k++) {
+            double x = k - (SINCTAPS / 2 - 1) - frac;
+            double s = x == 0.0 ? fc : sin(M_PI * fc * x) / (M_PI * x);
+            double w = (x + SINCTAPS / 2) / SINCTAPS;
+            w = 0.42 - 0.5 * cos(2.0 * M_PI * w) + 0.08 * cos(4.0 * M_PI * w);
+            table[p * SINCTAPS + k] = s * w;
+        }
+    }
+}
+
+// estimate the clock drift between stimulus and target at several points of the take
+// and resample the target when the drift sum up to more then a quarter sample
+bool Profil::compensate_drift(float *buf, int n) {
+    driftppm = 0.0;
+    driftfixed = false;
+    if (channel != 1 || !tape1) return false;
+    int ns = fmin(n, inputsize);
+    // the windows have to fit into the stimulus
+    if (ns < DRIFTWIN + 3 * DRIFTSEARCH) return false;
+    const int points = 16;
+    double px[points], py[points];
+    int valid = 0;
+    int center = 0;
+    for (int k = 0; k < points; k++) {
+        int pos = DRIFTSEARCH + (long long)k * (ns - DRIFTWIN - 3 * DRIFTSEARCH) / (points - 1);
+        pos = fmin(pos, ns - DRIFTWIN - DRIFTSEARCH);
+        double lag = window_lag(tape1, buf, n, pos, center);
+        if (lag > MAXLAG) continue;
+        px[valid] = pos + DRIFTWIN / 2;
+        py[valid] = lag;
+        center = int(floor(lag + 0.5));
+        valid++;
+    }
+    if (valid < 4) return false;
+    // least squares fit of lag over position
+    double mx = 0.0, my = 0.0, sxx = 0.0, sxy = 0.0;
+    for (int k = 0; k < valid; k++) { mx += px[k]; my += py[k]; }
+    mx /= valid;
+    my /= valid;
+    for (int k = 0; k < valid; k++) {
+        sxx += (px[k] - mx) * (px[k] - mx);
+        sxy += (px[k] - mx) * (py[k] - my);
+    }
+    if (sxx <= 0.0) return false;
+    double slope = sxy / sxx;
+    double resid = 0.0;
+    for (int k = 0; k < valid; k++)
+        resid = fmax(resid, std::fabs(py[k] - (my + slope * (px[k] - mx))));
+    driftppm = slope * 1e6;
+    // only resample when the drift is significant and the fit is trustworthy
+    if (std::fabs(slope) * n < 0.25 || resid > 1.0) return false;
+
+    float *out = NULL;
+    float *table = NULL;
+    try {
+        out = new float[n];
+        table = new float[(SINCPHASES + 1) * SINCTAPS];
+    } catch(...) {
+        delete[] out;
+        return false;
+    }
+    make_sinc(table);
+    const Kernels& k = kernels();
+    // each output sample only reads the input, so the take is resampled in parallel chunks
+    pool().parallel((n + POOLCHUNK - 1) / POOLCHUNK, [&](int c) {
+        const int end = fmin(n, (c + 1) * POOLCHUNK);
+        for (int i = c * POOLCHUNK; i < end; i++) {
+            double t = i * (1.0 + slope);
+            int it = int(floor(t));
+            double f = (t - it) * SINCPHASES;
+            int ph = int(f);
+            float fr = f - ph;
+            const float *h0 = table + ph * SINCTAPS;
+            const float *h1 = h0 + SINCTAPS;
+            int start = it - (SINCTAPS / 2 - 1);
+            if (start >= 0 && start + SINCTAPS <= n) {
+                out[i] = k.fir(buf + start, h0, h1, fr, SINCTAPS);
+                continue;
+            }
+            // the edges, where the taps run out of the buffer
+            float sum = 0.0;
+            for (int t = 0; t < SINCTAPS; t++) {
+                int j = start + t;
+                if (j < 0 || j >= n) continue;
+                sum += buf[j] * (h0[t] + fr * (h1[t] - h0[t]));
+            }
+            out[i] = sum;
+        }
+    });
+    memcpy(buf, out, n * sizeof(float));
+    delete[] out;
+    delete[] table;
+    driftfixed = true;
+    return true;
+}
+
+// correlation of stimulus and target over one window at a fixed lag
+static double window_corr(const float *stim, const float *tgt, int pos, int lag, int len) {
+    const Kernels& k = kernels();
+    double xy = k.dot(stim + pos, tgt + pos + lag, len);
+    double xx = 1e-20 + k.dot(stim + pos, stim + pos, len);
+    double yy = 1e-20 + k.dot(tgt + pos + lag, tgt + pos + lag, len);
+    return xy / sqrt(xx * yy);
+}
+
+// find the sample where the lag switched from old to new between start and end
+static int split_point(const float *stim, const float *tgt, int start, int end, int lold, int lnew, double sign) {
+    // maximise sum(old products before the split) + sum(new products after the split)
+    double after = 0.0;
+    for (int i = start; i < end; i++) after += sign * stim[i] * tgt[i + lnew];
+    double before = 0.0, best = after;
+    int pos = start;
+    for (int i = start; i < end; i++) {
+        before += sign * stim[i] * tgt[i + lold];
+        after -= sign * stim[i] * tgt[i + lnew];
+        if (before + after > best) {
+            best = before + after;
+            pos = i + 1;
+        }
+    }
+    return pos;
+}
+
+// track the lag of the target against the stimulus window by window, a jump of the lag
+// means the host dropped or duplicated a block, a dead target means the signal got lost
+#define DROPWIN 2048
+#define DROPSEARCH 2048
+#define MAXSEARCHES 64
+
+void Profil::detect_dropouts(const float *buf, int n) {
+    dropouts.clear();
+    if (channel != 1 || !tape1) return;
+    int ns = fmin(n, inputsize);
+    int center = 0;
+    int lastgood = -1;
+    int lostpos = -1;
+    double avgc = 0.0;
+    int searches = 0;
+    for (int pos = DROPSEARCH; pos + DROPWIN + DROPSEARCH < ns; pos += DROPWIN) {
+        double xx = 0.0, yy = 0.0;
+        for (int i = 0; i < DROPWIN; i++) {
+            xx += tape1[pos + i] * tape1[pos + i];
+            yy += buf[pos + center + i] * buf[pos + center + i];
+        }
+        // skip near silent stimulus
+        if (xx < DROPWIN * 1e-6) continue;
+        // lock on the lag in the first usable window
+        if (lastgood < 0) {
+            double bestc = 0.0;
+            for (int l = -DRIFTSEARCH; l <= DRIFTSEARCH; l++) {
+                double c = std::fabs(window_corr(tape1, buf, pos, l, DROPWIN));
+                if (c > bestc) {
+                    bestc = c;
+                    center = l;
+                }
+            }
+        }
+        double c = window_corr(tape1, buf, pos, center, DROPWIN);
+        if (lastgood < 0 || std::fabs(c) > 0.5 * std::fabs(avgc)) {
+            if (lostpos >= 0) {
+                DropOut d = { lostpos + center, 0, pos - lostpos };
+                dropouts.push_back(d);
+                lostpos = -1;
+            }
+            avgc = lastgood < 0 ? c : avgc * 0.9 + c * 0.1;
+            lastgood = pos;
+            continue;
+        }
+        // correlation broke, search the new lag in a wider range,
+        // but only for a limited number of times to keep non linear devices cheap
+        int best = center;
+        double bestc = 0.0;
+        bool search = yy > DROPWIN * 1e-8 && searches < MAXSEARCHES;
+        if (search) {
+            searches++;
+            // keep the lag inside the range the loop bounds are made for
+            for (int l = fmax(-DROPSEARCH, center - DROPSEARCH); l <= fmin(DROPSEARCH, center + DROPSEARCH); l++) {
+                double xy = 0.0;
+                for (int i = 0; i < DROPWIN; i++) xy += tape1[pos + i] * buf[pos + l + i];
+                if (std::fabs(xy) > bestc) {
+                    bestc = std::fabs(xy);
+                    best = l;
+                }
+            }
+        }
+        if (search && best != center && std::fabs(window_corr(tape1, buf, pos, best, DROPWIN)) > 0.5 * std::fabs(avgc)) {
+            int from = lostpos >= 0 ? lostpos : lastgood;
+            int at = split_point(tape1, buf, from, pos + DROPWIN, center, best, avgc < 0.0 ? -1.0 : 1.0);
+            DropOut d = { at + center, best - center, 0 };
+            dropouts.push_back(d);
+            center = best;
+            lastgood = pos;
+            lostpos = -1;
+        } else if (yy < DROPWIN * 1e-8 && lostpos < 0) {
+            lostpos = pos;
+        }
+    }
+    if (lostpos >= 0) {
+        DropOut d = { lostpos + center, 0, ns - lostpos };
+        dropouts.push_back(d);
+    }
+}
+
+// write the found dropouts as a json sidecar next to the target
+void Profil::write_dropouts() {
+    std::string fname = outputfile.substr(0, outputfile.find_last_of('.')) + ".dropouts.json";
+    std::ofstream os(fname);
+    os.imbue(std::locale::classic());
+    os << "{\"file\":" << json_string(outputfile.substr(get_path().size())) << ",\"dropouts\":[";
+    for (size_t i = 0; i < dropouts.size(); i++) {
+        os << (i ? "," : "") << "{\"position\":" << dropouts[i].position;
+        if (dropouts[i].shift) os << ",\"shift\":" << dropouts[i].shift;
+        else os << ",\"lost\":" << dropouts[i].length;
+        os << "}";
+    }
+    os << "]}\n";
+}
+
+// a quick look linear (FIR) model of target vs. stimulus, fitted chunk by chunk while recording.
+// The Welch estimate of the cross and auto spectra gives the best linear fit per bin,
+// H = Sxy / Sxx, and the power it leaves unexplained, Syy - |Sxy|^2 / Sxx.
+// The ratio of that residual to the target power is the ESR of the linear baseline,
+// a lower bound of what a trained model should reach.
+#define FITSIZE 4096   // fft size, the frames overlap by the half
+
+// restart the linear model fit for a new take
+void Profil::fit_reset() {
+    fitesr = -1.0;
+    fitfill = 0;
+    fitpos = -1;
+    if (!fitbuf) {
+        try {
+            fitbuf = new float[FITSIZE];
+            fitwin = new float[FITSIZE];
+            fitspec = new std::complex<float>[FITSIZE];
+            fitacc = new double[4 * (FITSIZE / 2 + 1)];
+        } catch(...) {
+            if (fitbuf) { delete[] fitbuf; fitbuf = 0; }
+            if (fitwin) { delete[] fitwin; fitwin = 0; }
+            if (fitspec) { delete[] fitspec; fitspec = 0; }
+            return;
+        }
+        for (int k = 0; k < FITSIZE; k++)
+            fitwin[k] = 0.5 - 0.5 * cos(2.0 * M_PI * k / FITSIZE);
+    }
+    memset(fitacc, 0, 4 * (FITSIZE / 2 + 1) * sizeof(double));
+}
+
+// add one hann windowed frame of the target history and the matching stimulus to the spectra,
+// both real signals go through one complex fft
+void Profil::fit_frame(int64_t start) {
+    const float *x = tape1 + start * channel;
+    for (int k = 0; k < FITSIZE; k++)
+        fitspec[k] = std::complex<float>(x[k * channel] * fitwin[k], fitbuf[k] * fitwin[k]);
+    fft(fitspec, FITSIZE);
+    double *sxx = fitacc;
+    double *syy = sxx + FITSIZE / 2 + 1;
+    double *sxyr = syy + FITSIZE / 2 + 1;
+    double *sxyi = sxyr + FITSIZE / 2 + 1;
+    for (int k = 0; k <= FITSIZE / 2; k++) {
+        const std::complex<float> z = fitspec[k];
+        const std::complex<float> zc = std::conj(fitspec[(FITSIZE - k) & (FITSIZE - 1)]);
+        const std::complex<float> X = (z + zc) * 0.5f;
+        const std::complex<float> Y = (z - zc) * std::complex<float>(0.0f, -0.5f);
+        const std::complex<float> XY = std::conj(X) * Y;
+        sxx[k] += std::norm(X);
+        syy[k] += std::norm(Y);
+        sxyr[k] += XY.real();
+        sxyi[k] += XY.imag();
+    }
+}
+
+// feed a recorded chunk, pos is the stimulus frame the chunk starts at
+void Profil::fit_chunk(const float *buf, int n, int64_t pos) {
+    if (!fitbuf || !tape1) return;
+    // a gap in the stream starts a new history
+    if (pos != fitpos) fitfill = 0;
+    const int frames = n / channel;
+    const int64_t stimframes = inputsize / channel;
+    for (int i = 0; i < frames; i++) {
+        fitbuf[fitfill++] = buf[i * channel];
+        if (fitfill < FITSIZE) continue;
+        const int64_t start = pos + i + 1 - FITSIZE;
+        if (start >= 0 && start + FITSIZE <= stimframes) fit_frame(start);
+        memmove(fitbuf, fitbuf + FITSIZE / 2, FITSIZE / 2 * sizeof(float));
+        fitfill = FITSIZE / 2;
+    }
+    fitpos = pos + frames;
+}
+
+// send the running ESR of the linear fit
+void Profil::fit_report() {
+    if (!fitacc) return;
+    const double *sxx = fitacc;
+    const double *syy = sxx + FITSIZE / 2 + 1;
+    const double *sxyr = syy + FITSIZE / 2 + 1;
+    const double *sxyi = sxyr + FITSIZE / 2 + 1;
+    double e = 0.0;
+    double s = 0.0;
+    for (int k = 0; k <= FITSIZE / 2; k++) {
+        s += syy[k];
+        if (sxx[k] > 1e-20) e += fmax(0.0, syy[k] - (sxyr[k] * sxyr[k] + sxyi[k] * sxyi[k]) / sxx[k]);
+        else e += syy[k];
+    }
+    if (s < 1e-20) return;
+    fitesr = e / s;
+    setOutputParameterValue(FITESR, fitesr);
+}
+
+// write one file of the export pair, straight from the given buffer
+static bool write_export(std::string fname, const float *buf, int n, int channels, int samplerate, int format) {
+    SF_INFO sfinfo ;
+    sfinfo.channels = channels;
+    sfinfo.samplerate = samplerate;
+    sfinfo.format = SF_FORMAT_WAV | format;
+    SNDFILE * sf = sf_open(fname.c_str(), SFM_WRITE, &sfinfo);
+    if (!sf) return false;
+    sf_command(sf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    bool ret = sf_write_float(sf, buf, n) == n;
+    sf_close(sf);
+    return ret;
+}
+
+// export a training ready pair to "dataset_N/": the stimulus and the aligned target,
+// both trimmed to the region where the stimulus plays, plus a json manifest
+// with the latency, levels and the optional train/validation split
+void Profil::export_take(const float *buf, int n, const float *ref) {
+    int frames = fmin(n, inputsize) / channel;
+    int start = 0;
+    int end = frames;
+    while (start < end && std::fabs(tape1[start * channel]) < EXPORTFLOOR) start++;
+    while (end > start && std::fabs(tape1[(end - 1) * channel]) < EXPORTFLOOR) end--;
+    if (end <= start) return;
+    frames = end - start;
+
+    int format = fexport > 1.5f ? SF_FORMAT_PCM_24 : SF_FORMAT_FLOAT;
+    std::string dir = get_path() + "dataset_" + to_string(capindex) + PATH_SEPARATOR;
+    make_dir(dir);
+    if (!write_export(dir + "input.wav", tape1 + start * channel, frames * channel, channel, fSamplingFreq, format) ||
+        !write_export(dir + "target.wav", buf + start * channel, frames * channel, channel, fSamplingFreq, format))
+        return;
+    // the reference input over the same region, in the time base of the target
+    if (ref && !write_export(dir + "reference.wav", ref + start * channel, frames * channel, channel, fSamplingFreq, format))
+        ref = NULL;
+
+    // validation is taken from the end of the take
+    int split = frames - int(float(frames) * fmin(50.0f, fmax(0.0f, fsplit)) / 100.0f);
+    std::ofstream os(dir + "manifest.json");
+    os.imbue(std::locale::classic());
+    os << "{\"index\":" << capindex
+       << ",\"input\":\"input.wav\",\"target\":\"target.wav\""
+       << ",\"source\":" << json_string(outputfile.substr(get_path().size()))
+       << ",\"stimulus_hash\":\"" << std::hex << std::setw(16) << std::setfill('0') << stimulushash << std::dec << "\""
+       << ",\"samplerate\":" << fSamplingFreq
+       << ",\"channels\":" << channel
+       << ",\"format\":\"" << (format == SF_FORMAT_FLOAT ? "float32" : "pcm24") << "\""
+       << ",\"frames\":" << frames
+       << ",\"offset\":" << start
+       << ",\"latency\":" << caplatency
+       << ",\"input_peak\":" << fConst2
+       << ",\"target_peak\":" << fConst1
+       << ",\"gain\":" << nf
+       << ",\"trim\":" << intrim
+       << ",\"drift_ppm\":" << driftppm
+       << ",\"dropouts\":" << dropouts.size();
+    if (ref)
+        os << ",\"reference\":\"reference.wav\",\"reference_latency\":" << reflatency;
+    else if (refcorrected)
+        os << ",\"reference_corrected\":true,\"reference_latency\":" << reflatency;
+    if (seqopen >= 0)
+        os << ",\"params\":{" << seqparams << "}";
+    if (split < frames)
+        os << ",\"split\":{\"train\":[0," << split << "],\"validation\":[" << split << "," << frames << "]}";
+    os << "}\n";
+    exportdir = dir;
+}
+
+// the reference input records the reamp output looped straight back, so it holds the stimulus
+// through the converters and the reamp box only, not through the device.
+// The sidecar is always a wave file, the post processing reads it back.
+void Profil::open_reference() {
+    refname = outputfile.substr(0, outputfile.find_last_of('.')) + ".reference.wav";
+    SF_INFO sfinfo ;
+    sfinfo.channels = channel;
+    sfinfo.samplerate = fSamplingFreq;
+    sfinfo.format = ((inputsize + MAXRECSIZE) * 3 > WAVLIMIT ? SF_FORMAT_RF64 : SF_FORMAT_WAV) | SF_FORMAT_PCM_24;
+    reffile = sf_open(refname.c_str(), SFM_WRITE, &sfinfo);
+    if (reffile) sf_command(reffile, SFC_SET_CLIPPING, NULL, SF_TRUE);
+    else refname.clear();
+}
+
+#define REFLAGSIZE 65536   // fft size of the reference lag search
+#define REFREG 1e-3        // regularisation of the inverse, relative to the peak of |H|^2
+
+// lag of the reference against the stimulus, from a fft cross correlation over the loudest part
+// of the stimulus. Returns INT_MAX when the reference holds no copy of the stimulus.
+static int reference_lag(const float *stim, const float *ref, int n, int64_t peakpos) {
+    const int N = REFLAGSIZE;
+    const int start = fmax(0, fmin(peakpos - N / 2, n - N));
+    std::vector<std::complex<float> > z(N);
+    double xx = 1e-20;
+    double yy = 1e-20;
+    for (int k = 0; k < N && start + k < n; k++) {
+        const float x = stim[start + k];
+        const float y = ref[start + k];
+        xx += x * x;
+        yy += y * y;
+        z[k] = std::complex<float>(x, y);
+    }
+    // both real signals go through one complex fft, the cross spectrum is X* Y
+    fft(z.data(), N);
+    std::vector<std::complex<float> > r(N);
+    for (int k = 0; k < N; k++) {
+        const std::complex<float> zc = std::conj(z[(N - k) & (N - 1)]);
+        const std::complex<float> X = (z[k] + zc) * 0.5f;
+        const std::complex<float> Y = (z[k] - zc) * std::complex<float>(0.0f, -0.5f);
+        r[k] = std::conj(X) * Y;
+    }
+    ifft(r.data(), N);
+    int best = 0;
+    float bestc = 0.0;
+    for (int l = -N / 4; l < N / 4; l++) {
+        const float c = std::fabs(r[l & (N - 1)].real());
+        if (c > bestc) {
+            bestc = c;
+            best = l;
+        }
+    }
+    // a silent reference, or no peak
+    if (yy < N * EXPORTFLOOR * EXPORTFLOOR || bestc / sqrt(xx * yy) < 0.3) return INT_MAX;
+    return best;
+}
+
+// filter the target with the inverse of the interface. H = Sxy / Sxx of the reference (shifted
+// by its lag) against the stimulus is estimated from hann windowed frames like the linear fit,
+// the inverse conj(H) / (|H|^2 + e) is regularised, so bins where the interface has no gain
+// aren't blown up, and bins the stimulus doesn't excite are left alone. The filter is centred
+// and windowed, the target is filtered by overlap-save and the delay of the filter compensated.
+static bool reference_correct(float *buf, int n, const float *stim, const float *ref, int m, int lag) {
+    const int N = FITSIZE;
+    const int H2 = N / 2 + 1;
+    const int first = fmax(0, -lag);
+    const int last = m - N - fmax(0, lag);
+    if (last < first) return false;
+    const int frames = (last - first) / (N / 2) + 1;
+    const int per = 64; // frames per task
+    const int tasks = (frames + per - 1) / per;
+    std::vector<double> acc(size_t(tasks) * 3 * H2, 0.0);
+    std::vector<float> win(N);
+    for (int k = 0; k < N; k++) win[k] = 0.5 - 0.5 * cos(2.0 * M_PI * k / N);
+    pool().parallel(tasks, [&](int t) {
+        std::vector<std::complex<float> > z(N);
+        double *sxx = &acc[size_t(t) * 3 * H2];
+        double *sxyr = sxx + H2;
+        double *sxyi = sxyr + H2;
+        const int end = fmin(frames, (t + 1) * per);
+        for (int f = t * per; f < end; f++) {
+            const float *x = stim + first + f * (N / 2);
+            const float *y = ref + first + f * (N / 2) + lag;
+            for (int k = 0; k < N; k++) z[k] = std::complex<float>(x[k] * win[k], y[k] * win[k]);
+            fft(z.data(), N);
+            for (int k = 0; k < H2; k++) {
+                const std::complex<float> zc = std::conj(z[(N - k) & (N - 1)]);
+                const std::complex<float> X = (z[k] + zc) * 0.5f;
+                const std::complex<float> Y = (z[k] - zc) * std::complex<float>(0.0f, -0.5f);
+                const std::complex<float> XY = std::conj(X) * Y;
+                sxx[k] += std::norm(X);
+                sxyr[k] += XY.real();
+                sxyi[k] += XY.imag();
+            }
+        }
+    });
+    for (int t = 1; t < tasks; t++)
+        for (int k = 0; k < 3 * H2; k++) acc[k] += acc[size_t(t) * 3 * H2 + k];
+    const double *sxx = &acc[0];
+    const double *sxyr = sxx + H2;
+    const double *sxyi = sxyr + H2;
+    double smax = 0.0;
+    for (int k = 0; k < H2; k++) smax = fmax(smax, sxx[k]);
+    if (smax < 1e-20) return false;
+    std::vector<std::complex<double> > H(H2);
+    double hmax = 0.0;
+    for (int k = 0; k < H2; k++) {
+        H[k] = sxx[k] > 1e-10 * smax ? std::complex<double>(sxyr[k], sxyi[k]) / sxx[k] : 1.0;
+        hmax = fmax(hmax, std::norm(H[k]));
+    }
+    std::vector<std::complex<float> > g(N);
+    for (int k = 0; k < H2; k++) {
+        const std::complex<double> G = std::conj(H[k]) / (std::norm(H[k]) + REFREG * hmax);
+        g[k] = std::complex<float>(G.real(), G.imag());
+        if (k > 0 && k < N / 2) g[N - k] = std::conj(g[k]);
+    }
+    ifft(g.data(), N);
+    // the spectrum of the centred filter, zero padded to twice the length
+    std::vector<std::complex<float> > gm(2 * N);
+    for (int k = 0; k < N; k++) gm[k] = g[(k + N / 2) & (N - 1)].real() * win[k];
+    fft(gm.data(), 2 * N);
+    float *out = NULL;
+    try {
+        out = new float[n];
+    } catch(...) {
+        return false;
+    }
+    pool().parallel((n + POOLCHUNK - 1) / POOLCHUNK, [&](int c) {
+        std::vector<std::complex<float> > seg(2 * N);
+        const int end = fmin(n, (c + 1) * POOLCHUNK);
+        for (int s = c * POOLCHUNK; s < end; s += N) {
+            // the input of N outputs starts a filter length before, shifted by the filter delay
+            const int a = s + N / 2 - (N - 1);
+            for (int k = 0; k < 2 * N; k++)
+                seg[k] = (a + k >= 0 && a + k < n) ? buf[a + k] : 0.0f;
+            fft(seg.data(), 2 * N);
+            for (int k = 0; k < 2 * N; k++) seg[k] *= gm[k];
+            ifft(seg.data(), 2 * N);
+            for (int i = 0; i < N && s + i < end; i++) out[s + i] = seg[N - 1 + i].real();
+        }
+    });
+    memcpy(buf, out, n * sizeof(float));
+    delete[] out;
+    return true;
+}
+
+// take the coloration of the interface out of the target. The lag of the reference against the
+// stimulus gives the latency of the interface alone, in correct mode the target is filtered with
+// the inverse of the interface, in export mode the reference is kept next to the target.
+// returns true when the target was changed
+bool Profil::reference_process(float *buf, int n, const float *ref) {
+    if (refname.empty()) return false;
+    const int m = fmin(n, inputsize);
+    int lag = INT_MAX;
+    if (ref && channel == 1 && tape1) lag = reference_lag(tape1, ref, m, stimpeakpos);
+    if (lag == INT_MAX) {
+        // no stimulus on the reference input, the target is kept as it is
+        post_error(11.0);
+        std::remove(refname.c_str());
+        refname.clear();
+        return false;
+    }
+    reflatency = caplatency + lag;
+    if (refmode < 2 || !reference_correct(buf, n, tape1, ref, m, lag)) return false;
+    refcorrected = true;
+    std::remove(refname.c_str());
+    refname.clear();
+    // the interface gain is gone as well, check the normalisation again
+    fConst1 = fmax(0.1f, kernels().peak(buf, n));
+    nf = fConst1 > fConst2 ? fConst2 / fConst1 : 1.0;
+    return true;
+}
+
+// load the finished recording, run the post processing stages in memory
+// and write it back once when something was changed.
+// returns false when the take should be rejected
+bool Profil::post_process() {
+    reflatency = -1;
+    refcorrected = false;
+    SF_INFO sfinfo;
+    sfinfo.format = 0;
+    SNDFILE *sf = sf_open(outputfile.c_str(), SFM_READ, &sfinfo);
+    if (!sf) return true;
+    // the checks run in memory, a take too long for that is kept unchecked
+    if (sfinfo.frames * sfinfo.channels + skipped > INT_MAX) {
+        sf_close(sf);
+        if (skipped) expand_take(outputfile, silentskip);
+        return true;
+    }
+    int n = sfinfo.frames * sfinfo.channels;
+    float *buf = NULL;
+    try {
+        buf = new float[n + skipped];
+    } catch(...) {
         sf_close(sf);
+        if (skipped) expand_take(outputfile, silentskip);
+        err = true;
+        return true;
+    }
+    n = sf_read_float(sf, buf, n);
+    sf_close(sf);
+    exportdir.clear();
+    // a take with skipped silence is expanded to its full length first
+    if (skipped) n = expand_runs(buf, n, silentskip);
+    // the reference input, recorded in the same frames as the target
+    float *ref = NULL;
+    if (!refname.empty()) {
+        int64_t rn = 0;
+        int c = 0, r = 0;
+        ref = read_sound(refname, &rn, &c, &r);
+        if (ref && (rn != n || c != channel)) {
+            delete[] ref;
+            ref = NULL;
+        }
+    }
+    // the interface is taken out first, in the time base both were recorded in
+    bool changed = reference_process(buf, n, ref) || skipped;
+    if (compensate_drift(buf, n)) changed = true;
+    detect_dropouts(buf, n);
+    if (!dropouts.empty()) {
+        write_dropouts();
+        post_error(freject > 0.5f ? 7.0 : 6.0);
+        if (freject > 0.5f) {
+            delete[] buf;
+            delete[] ref;
+            return false;
+        }
+    }
+    if (std::fabs(nf - 1.0) > 0.01) {
+        normalize(buf, n);
+        changed = true;
+    }
+    if (fexport > 0.5f) export_take(buf, n, refname.empty() ? NULL : ref);
+    if (changed) {
+        sf = open_stream(outputfile);
+        if (sf) {
+            save_to_wave(sf, buf, n);
+            sf_close(sf);
+        }
+    }
+    delete[] buf;
+    delete[] ref;
+    return true;
+}
+
+// read ahead the target for the null test, straight into the free part of the ring
+void Profil::null_fill() {
+    uint32_t w = nullwrite.load(std::memory_order_relaxed);
+    while (nullsf) {
+        uint32_t used = w - nullread.load(std::memory_order_acquire);
+        if (used >= NULLRING) break;
+        uint32_t off = w & (NULLRING - 1);
+        int len = std::min(NULLRING - off, NULLRING - used);
+        int got = sf_read_float(nullsf, nullring + off, len);
+        if (got <= 0) {
+            close_stream(&nullsf);
+            break;
+        }
+        if (nullgain != 1.0f) apply_gain(nullring + off, nullgain, got);
+        w += got;
+        nullwrite.store(w, std::memory_order_release);
+    }
+}
+
+// the worker side of the null test: open the last capture and prefill the ring,
+// keep it filled while the test runs and close the file when it's done
+void Profil::null_stream() {
+    int state = nullstate.load(std::memory_order_acquire);
+    if (state == NT_OPEN) {
+        close_stream(&nullsf);
+        if (!nullring) {
+            try {
+                nullring = new float[NULLRING];
+            } catch(...) {
+                nullring = NULL;
+            }
+        }
+        nullwrite.store(0, std::memory_order_relaxed);
+        nullread.store(0, std::memory_order_relaxed);
+        if (nullring && !nullfile.empty()) {
+            SF_INFO sfinfo;
+            sfinfo.format = 0;
+            nullsf = sf_open(nullfile.c_str(), SFM_READ, &sfinfo);
+            if (nullsf && (sfinfo.channels != channel || sfinfo.samplerate != fSamplingFreq))
+                close_stream(&nullsf);
+        }
+        if (!nullsf) {
+            nullstate.compare_exchange_strong(state, NT_FAIL, std::memory_order_acq_rel);
+            return;
+        }
+        null_fill();
+        // when the test was stopped meanwhile, the next wake up close the file
+        nullstate.compare_exchange_strong(state, NT_READY, std::memory_order_acq_rel);
+    } else if (state == NT_READY) {
+        null_fill();
+    } else if (state == NT_CLOSE) {
+        close_stream(&nullsf);
+        nullstate.store(NT_IDLE, std::memory_order_release);
+    }
+}
+
+// drive the null test from the audio thread, returns true while the comparison runs
+inline bool Profil::null_control(bool busy) {
+    int state = nullstate.load(std::memory_order_acquire);
+    if (state == NT_IDLE) nullwake.store(false, std::memory_order_relaxed);
+    if (fnull < 0.5f) nullarmed = true;
+    if (fnull > 0.5f && nullarmed && !busy) {
+        if (state == NT_IDLE) {
+            nullrt = 0;
+            nullmeasure = 0;
+            nullpos = 0;
+            nulllatency = 0;
+            nullcount = 0;
+            nullerr = nullsig = 0.0;
+            nullerrsum = nullsigsum = 0.0;
+            mtdm_clear(mtdm);
+            nullstate.store(NT_OPEN, std::memory_order_release);
+        } else if (state == NT_READY) {
+            // top up the ring when it runs below the half
+            if (nullwrite.load(std::memory_order_acquire) - nullread.load(std::memory_order_relaxed) < NULLRING / 2) {
+                nullwake.store(true, std::memory_order_release);
+                worker.notify();
+            }
+            return true;
+        } else if (state == NT_FAIL) {
+            // no finished capture to compare against
+            nullarmed = false;
+            nullstate.store(NT_IDLE, std::memory_order_release);
+            post_error(8.0);
+            requestParameterValueChange((PortIndex)NULLTEST, 0.0f);
+            return false;
+        }
+    } else if (state == NT_READY) {
+        nullstate.store(NT_CLOSE, std::memory_order_release);
+    } else if (state == NT_FAIL) {
+        nullstate.store(NT_IDLE, std::memory_order_release);
+        return false;
+    } else if (state == NT_IDLE) {
+        return false;
+    }
+    // the worker didn't answer yet, wake it again
+    nullwake.store(true, std::memory_order_release);
+    worker.notify();
+    return false;
+}
+
+// send the null depth and the error to signal ratio (ESR) of the residual
+void Profil::null_report(double e, double s) {
+    if (s < 1e-10) return;
+    double esr = e / s;
+    setOutputParameterValue(ESR, esr);
+    setOutputParameterValue(NULLDEPTH, 10.0 * log10(fmax(esr, 1e-12)));
+}
+
+// play the stimulus and compare the returning signal with the latency compensated target
+inline float Profil::null_sample(float in) {
+    float out = 0.0;
+    if (nulllatency > nullrt) {
+        uint32_t r = nullread.load(std::memory_order_relaxed);
+        if (r != nullwrite.load(std::memory_order_acquire)) {
+            float t = nullring[r & (NULLRING - 1)];
+            nullread.store(r + 1, std::memory_order_release);
+            float e = in - t;
+            nullerr += e * e;
+            nullsig += t * t;
+        }
+    }
+    if (nullpos < inputsize) out = tape1[nullpos++];
+    nulllatency++;
+    // report the running error once per second
+    if (++nullcount >= fSamplingFreq) {
+        null_report(nullerr, nullsig);
+        nullerrsum += nullerr;
+        nullsigsum += nullsig;
+        nullerr = nullsig = 0.0;
+        nullcount = 0;
+    }
+    if (nulllatency > inputsize + nullrt) {
+        // done, report the result over the whole take
+        null_report(nullerrsum + nullerr, nullsigsum + nullsig);
+        nullrun = false;
+        nullarmed = false;
+        requestParameterValueChange((PortIndex)NULLTEST, 0.0f);
+    }
+    return out;
+}
+
+// resolve the roundtrip latency from the mtdm measurement,
+// returns 0 when the latency is set, otherwise the error number
+int Profil::resolve_latency(int *lat) {
+    // no signal comes in
+    if (mtdm_resolve (mtdm) < 0) return 1;
+    // when phase is inverted resolve with inverted frames
+    if (mtdm->_err > 0.3) {
+        mtdm_invert ( mtdm );
+        mtdm_resolve ( mtdm );
+    }
+    // seems we receive garbage
+    if (mtdm->_err > 0.2) return 2;
+    *lat = lround(mtdm->_del);
+    return 0;
+}
+
+// fast start: a latency stored for this samplerate and buffer size only needs to be
+// confirmed by a short measurement, when it doesn't match the full measurement runs on
+bool Profil::confirm_latency(int frames) {
+    const int known = knownrt.load(std::memory_order_relaxed);
+    if (!known || frames < known + fSamplingFreq / 10) return false;
+    if (mtdm_resolve (mtdm) < 0) return false;
+    const int inv = mtdm->_inv;
+    if (mtdm->_err > 0.3) {
+        mtdm_invert ( mtdm );
+        mtdm_resolve ( mtdm );
+    }
+    if (mtdm->_err < FASTERR && std::abs(lround(mtdm->_del) - known) <= 1) return true;
+    mtdm->_inv = inv;
+    return false;
+}
+
+// move the last confirmed latency into the table, called outside the audio thread
+void Profil::latency_merge() {
+    const int rt = confirmedrt.exchange(0);
+    if (!rt) return;
+    for (size_t i = 0; i < latcal.size(); i++) {
+        if (latcal[i].rate == fSamplingFreq && latcal[i].frames == blocksize) {
+            latcal[i].latency = rt;
+            latcal[i].err = confirmederr;
+            return;
+        }
+    }
+    LatencyCal c = { fSamplingFreq, blocksize, rt, confirmederr };
+    latcal.push_back(c);
+}
+
+// pick the stored latency for the current samplerate and buffer size
+void Profil::latency_lookup() {
+    std::lock_guard<std::mutex> lk(latmutex);
+    latency_merge();
+    int rt = 0;
+    for (size_t i = 0; i < latcal.size(); i++)
+        if (latcal[i].rate == fSamplingFreq && latcal[i].frames == blocksize) rt = latcal[i].latency;
+    knownrt.store(rt, std::memory_order_relaxed);
+}
+
+// level calibration: before the capture a 100ms burst from the loudest part of the stimulus
+// is played at -24, -18, -12, -6 and 0dB. The returning peaks give the loop gain and the
+// headroom, the input trim then puts the target 1dB below the stimulus peak, so the
+// normalisation pass isn't needed. When the full level step clips, the capture is stopped.
+
+static const float calsteps[CALSTEPS] = { 0.0631f, 0.1259f, 0.2512f, 0.5012f, 1.0f };
+
+// find the loudest part of the stimulus once it's loaded
+void Profil::calibrate_init() {
+    callen = fSamplingFreq / 10;
+    if (inputsize < callen || stimpeak < EXPORTFLOOR) {
+        callen = 0;
+        return;
+    }
+    calstart = fmin(inputsize - callen, fmax(0, stimpeakpos - callen / 2));
+}
+
+// play the burst and collect the returning peak per step, delayed by the roundtrip latency
+inline float Profil::calibrate_sample(float in) {
+    float out = 0.0;
+    if (calpos < CALSTEPS * callen)
+        out = tape1[calstart + calpos % callen] * calsteps[calpos / callen];
+    int rpos = calpos - roundtrip;
+    if (rpos >= 0 && rpos < CALSTEPS * callen) {
+        if (rpos % callen == 0) calpeak[rpos / callen] = 0.0;
+        calpeak[rpos / callen] = fmax(calpeak[rpos / callen], fabsf(in));
+    }
+    if (++calpos > CALSTEPS * callen + roundtrip) calibrate_finish();
+    return out;
+}
+
+// evaluate the steps, set the trim or stop the capture when the input clips
+void Profil::calibrate_finish() {
+    calpos = -1;
+    calibrated = true;
+    if (calpeak[CALSTEPS - 1] >= CLIPLEVEL) {
+        // guess the full level peak from the loudest step which didn't clip
+        float expected = 1.0;
+        for (int s = CALSTEPS - 2; s >= 0; s--) {
+            if (calpeak[s] < CLIPLEVEL) {
+                expected = calpeak[s] / calsteps[s];
+                break;
+            }
+        }
+        headroom = -20.0 * log10(fmax(expected, CLIPLEVEL));
+        setOutputParameterValue(HEADROOM, headroom);
+        roundtrip = 0;
+        measure = 0;
+        latency = 0;
+        IOTAP = 0;
+        finish = 1;
+        post_error(9.0, headroom);
+        requestParameterValueChange((PortIndex)PROFILE, 0.0f);
+        return;
+    }
+    headroom = -20.0 * log10(fmax(calpeak[CALSTEPS - 1], 1e-6));
+    // put the target 1dB below the stimulus peak
+    intrim = fmin(TRIMLIMIT, fmax(1.0 / TRIMLIMIT, stimpeak * 0.891 / fmax(calpeak[CALSTEPS - 1], 1e-6)));
+    setOutputParameterValue(HEADROOM, headroom);
+    setOutputParameterValue(TRIM, 20.0 * log10(intrim));
+}
+
+// the capture queue "sequence.txt" in the profiles folder hold one take per line, like
+//   gain=3 tone=5 cc:1:20:38 cc:1:21:64 settle=4
+// cc:channel:controller:value and pc:channel:program are send to the device before the take,
+// settle= overrides the settle time, key=value pairs go into the filename and the capture index.
+// Between the takes the worker flush the last take while the device settle,
+// each take measure the roundtrip latency again.
+
+// keep only what is safe in a filename
+static std::string file_safe(const std::string& s) {
+    std::string r = s;
+    for (size_t i = 0; i < r.size(); i++)
+        if (!isalnum((unsigned char)r[i]) && r[i] != '.' && r[i] != '-' && r[i] != '+') r[i] = '_';
+    return r;
+}
+
+// a parameter value as json, numbers stay numbers
+static std::string json_value(const std::string& s) {
+    std::istringstream ss(s);
+    ss.imbue(std::locale::classic());
+    double d;
+    if ((ss >> d) && ss.eof()) return s;
+    return json_string(s);
+}
+
+// post a status event for the UI, from the audio thread or the worker
+void Profil::post_event(int type, int code, float value, const std::string& text) {
+    StatusEvent ev;
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    ev.time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    const size_t n = std::min(text.size(), sizeof(ev.text) - 1);
+    memcpy(ev.text, text.data(), n);
+    ev.text[n] = 0;
+    events.push(ev);
+}
+
+// raise a error on the port and as event, the port is cleared again after a second
+void Profil::post_error(float e, float value) {
+    errors = e;
+    reset_errors = 0;
+    setOutputParameterValue(ERRORS, errors);
+    post_event(EV_ERROR, int(e), value);
+}
+
+// start the waveform overview of a new take (or a new pass), tell the UI the length in bins
+void Profil::wave_start() {
+    wavefill = 0;
+    wavebin.pos = -1;
+    wavebin.length = (inputsize + WAVEBIN - 1) / WAVEBIN;
+    wavebin.tmin = wavebin.smin = 0.0;
+    wavebin.tmax = wavebin.smax = 0.0;
+    if (!pass && wave.push(wavebin)) wave.resynced();
+}
+
+// sum up a recorded sample and the stimulus sample at the same take position,
+// push a min/max bin each WAVEBIN samples and at the end of the stimulus,
+// the pair goes to the spectrum view as well
+inline void Profil::wave_sample(float t, int64_t pos) {
+    const float s = pos < inputsize ? tape1[pos] : 0.0;
+    spec.write(s, t);
+    // the UI was opened while the take runs, tell it the length again,
+    // the following bins carry the current position
+    if (wave.resync_wanted()) {
+        WaveBin start = { -1, int((inputsize + WAVEBIN - 1) / WAVEBIN), 0.0, 0.0, 0.0, 0.0 };
+        if (wave.push(start)) wave.resynced();
+    }
+    if (!wavefill) {
+        wavebin.tmin = wavebin.tmax = t;
+        wavebin.smin = wavebin.smax = s;
+    } else {
+        wavebin.tmin = fmin(wavebin.tmin, t);
+        wavebin.tmax = fmax(wavebin.tmax, t);
+        wavebin.smin = fmin(wavebin.smin, s);
+        wavebin.smax = fmax(wavebin.smax, s);
+    }
+    if (++wavefill == WAVEBIN || pos == inputsize - 1) {
+        wavebin.pos = pos / WAVEBIN;
+        wave.push(wavebin);
+        wavefill = 0;
+    }
+}
+
+// the worker side of the queue: read the queue file
+void Profil::sequence_stream() {
+    seqtakes.clear();
+    std::ifstream is(get_path() + "sequence.txt");
+    std::string line;
+    while (std::getline(is, line)) {
+        size_t c = line.find('#');
+        if (c != std::string::npos) line.erase(c);
+        std::istringstream ls(line);
+        std::string tok;
+        SeqTake take;
+        take.settle = -1.0;
+        bool used = false;
+        while (ls >> tok) {
+            int ch = 0, a = 0, b = 0;
+            size_t p = tok.find('=');
+            if (sscanf(tok.c_str(), "cc:%i:%i:%i", &ch, &a, &b) == 3) {
+                SeqMidi m = {3, {uint8_t(0xB0 | ((ch - 1) & 15)), uint8_t(a & 127), uint8_t(b & 127)}};
+                take.midi.push_back(m);
+            } else if (sscanf(tok.c_str(), "pc:%i:%i", &ch, &a) == 2) {
+                SeqMidi m = {2, {uint8_t(0xC0 | ((ch - 1) & 15)), uint8_t(a & 127), 0}};
+                take.midi.push_back(m);
+            } else if (tok.compare(0, 7, "settle=") == 0) {
+                std::istringstream ss(tok.substr(7));
+                ss.imbue(std::locale::classic());
+                ss >> take.settle;
+            } else if (p != std::string::npos && p > 0) {
+                take.params.push_back(std::make_pair(tok.substr(0, p), tok.substr(p + 1)));
+            } else {
+                continue;
+            }
+            used = true;
+        }
+        if (used) seqtakes.push_back(take);
+    }
+    int state = SQ_LOAD;
+    seqstate.compare_exchange_strong(state, seqtakes.empty() ? SQ_FAIL : SQ_READY, std::memory_order_acq_rel);
+}
+
+// note the parameters of the queued take which is about to be written
+void Profil::sequence_open() {
+    seqopen = seqcur.load(std::memory_order_acquire);
+    seqqueued = seqstate.load(std::memory_order_acquire) != SQ_IDLE;
+    seqname.clear();
+    seqparams.clear();
+    if (seqopen >= int(seqtakes.size())) seqopen = -1;
+    if (seqopen < 0) return;
+    const std::vector<std::pair<std::string, std::string> >& params = seqtakes[seqopen].params;
+    for (size_t i = 0; i < params.size(); i++) {
+        seqname += "_" + file_safe(params[i].first) + "-" + file_safe(params[i].second);
+        seqparams += (i ? ",\"" : "\"") + file_safe(params[i].first) + "\":" + json_value(params[i].second);
+    }
+}
+
+// leave the queue, a running take is aborted
+void Profil::sequence_stop() {
+    seqstate.store(SQ_IDLE, std::memory_order_release);
+    seqcur.store(-1, std::memory_order_release);
+    setOutputParameterValue(TAKE, 0.0);
+}
+
+// drive the capture queue from the audio thread, returns the capture switch for this cycle
+inline int Profil::sequence_control(int count) {
+    int state = seqstate.load(std::memory_order_acquire);
+    if (fseq < 0.5f || err) {
+        seqarmed = true;
+        // a loading queue is left when the worker answered
+        if (state != SQ_IDLE && state != SQ_LOAD) sequence_stop();
+        return int(fcheckbox0);
+    }
+    switch (state) {
+    case SQ_IDLE:
+        // start when no capture, null test or flush runs
+        if (!seqarmed || int(fcheckbox0) || IOTA || flushing.load(std::memory_order_acquire) ||
+            nullstate.load(std::memory_order_acquire) != NT_IDLE) return int(fcheckbox0);
+        seqarmed = false;
+        seqtake = 0;
+        seqstate.store(SQ_LOAD, std::memory_order_release);
+        seqwake.store(true, std::memory_order_release);
+        worker.notify();
+        return 0;
+    case SQ_READY:
+        if (seqtake >= int(seqtakes.size())) {
+            // all done
+            sequence_stop();
+            requestParameterValueChange((PortIndex)SEQUENCE, 0.0f);
+            return 0;
+        }
+        // step the device and let it settle
+        for (size_t i = 0; i < seqtakes[seqtake].midi.size(); i++)
+            writeMidiEvent(0, seqtakes[seqtake].midi[i].data, seqtakes[seqtake].midi[i].size);
+        seqwait = (seqtakes[seqtake].settle < 0.0 ? fsettle : seqtakes[seqtake].settle) * fSamplingFreq;
+        setOutputParameterValue(TAKE, seqtake + 1);
+        seqstate.store(SQ_SETTLE, std::memory_order_release);
+        return 0;
+    case SQ_SETTLE:
+        seqwait -= count;
+        // the next take waits until the last one is on disk
+        if (seqwait > 0 || flushing.load(std::memory_order_acquire)) return 0;
+        seqcur.store(seqtake, std::memory_order_release);
+        seqstate.store(SQ_RUN, std::memory_order_release);
+        return 1;
+    case SQ_RUN:
+        if (!finish) return 1;
+        // no signal, garbage, a missing input file or a clipping input stop the queue
+        if ((errors > 0.0 && errors < 5.0) || errors == 9.0) {
+            sequence_stop();
+            requestParameterValueChange((PortIndex)SEQUENCE, 0.0f);
+            return 0;
+        }
+        seqtake++;
+        seqstate.store(SQ_READY, std::memory_order_release);
+        return 0;
+    case SQ_FAIL:
+        // no queue file or no take in it
+        sequence_stop();
+        post_error(10.0);
+        requestParameterValueChange((PortIndex)SEQUENCE, 0.0f);
+        return 0;
+    default:
+        return 0;
     }
-    if (tape1) { delete[] tape1; tape1 = 0; }
-    load_from_wave(inputfile);
 }
 
 // close wav file when last chunk is written
 inline void Profil::close_stream(SNDFILE **sf) {
     if (*sf) sf_close(*sf);
     *sf = NULL;
-    if (std::fabs(nf - 1.0) > 0.01) normalize();
 }
 
 // allocate the internal recording buffers
 void Profil::mem_alloc() {
     if (!fRec0) fRec0 = new float[MAXRECSIZE];
     if (!fRec1) fRec1 = new float[MAXRECSIZE];
+    if (!fRef0) fRef0 = new float[MAXRECSIZE];
+    if (!fRef1) fRef1 = new float[MAXRECSIZE];
     mem_allocated = true;
 }
 
 // free the internal recording and play buffers
 void Profil::mem_free() {
     mem_allocated = false;
-    if (tape1) { delete[] tape1; tape1 = 0; }
+    // a stimulus change not yet picked up by the worker is dropped
+    stimwake.store(false, std::memory_order_release);
+    // the worker may still post process the last take
+    worker.sync();
+    close_stream(&nullsf);
+    nullstate.store(NT_IDLE, std::memory_order_release);
+    seqstate.store(SQ_IDLE, std::memory_order_release);
+    seqcur.store(-1, std::memory_order_release);
+    flushing.store(false, std::memory_order_release);
+    if (nullring) { delete[] nullring; nullring = 0; }
+    Stimulus s;
+    swap_stimulus(s);
+    free_stimulus(s);
+    free_stimulus(stimnext);
+    stimstate.store(ST_IDLE, std::memory_order_release);
+    if (avgbuf) { delete[] avgbuf; avgbuf = 0; }
+    if (passbuf) { delete[] passbuf; passbuf = 0; }
+    if (fitbuf) { delete[] fitbuf; fitbuf = 0; }
+    if (fitwin) { delete[] fitwin; fitwin = 0; }
+    if (fitspec) { delete[] fitspec; fitspec = 0; }
+    if (fitacc) { delete[] fitacc; fitacc = 0; }
     if (fRec0) { delete[] fRec0; fRec0 = 0; }
     if (fRec1) { delete[] fRec1; fRec1 = 0; }
+    if (fRef0) { delete[] fRef0; fRef0 = 0; }
+    if (fRef1) { delete[] fRef1; fRef1 = 0; }
 }
 
 // activate the plug
@@ -557,10 +2904,19 @@ int Profil::activate(bool start) {
     if (start) {
         if (!mem_allocated) {
             mem_alloc();
-            inputfile = get_ifilename();
-            load_from_wave(inputfile);
+            profilepath.clear();
+            // pick the dsp kernels for this cpu once, before the worker needs them
+            kernels();
+            stimindex = int(fstimulus);
+            Stimulus s;
+            load_stimulus(stimulusfile.empty() ? stimulus_file(stimindex) : stimulusfile, s);
+            swap_stimulus(s);
+            calibrate_init();
+            recover_captures();
+            load_index();
             clear_state_f();
         }
+        latency_lookup();
     } else if (mem_allocated) {
         mem_free();
     }
@@ -574,69 +2930,104 @@ int Profil::activate_plugin(bool start, Profil *p) {
 }
 
 // the process 
-void always_inline Profil::compute(int count, const float *input0, float *output0) {
+void always_inline Profil::compute(int count, const float *input0, const float *input1, float *output0) {
     if (err) fcheckbox0 = 0.0;
-    int iSlow0 = finish ? 0 : int(fcheckbox0);
+    // the capture queue switch the capture while it runs
+    int capture = sequence_control(count);
+    // a changed stimulus is swapped in between the takes
+    if (stimulus_control(roundtrip || measure || IOTA || flushing.load(std::memory_order_acquire) ||
+                         nullstate.load(std::memory_order_acquire) != NT_IDLE ||
+                         seqstate.load(std::memory_order_relaxed) != SQ_IDLE)) capture = 0;
+    // a capture waits until a null test released the worker
+    int iSlow0 = (finish || nullstate.load(std::memory_order_acquire) != NT_IDLE) ? 0 : capture;
     fcheckbox1 = int(fRecb2[0]);
-    if (!(int(fcheckbox0))) {
+    if (!capture) {
         finish = 0;
         roundtrip = 0;
         measure = 0;
-        errors = 0.0;
-        //setOutputParameterValue(ERRORS, errors);
+        calpos = -1;
         fbargraph1 = 0.0;
     }
 
+    // null test against the last finished capture, only while no capture runs
+    nullrun = null_control(capture || IOTA || seqstate.load(std::memory_order_relaxed) != SQ_IDLE);
+    // measure the roundtrip latency again, the loop may have changed since the capture
+    if (nullrun && !nullrt) {
+        mtdm_process (mtdm, count, input0, output0);
+        if (++nullmeasure < 128) return;
+        int e = resolve_latency(&nullrt);
+        if (!e) post_event(EV_LATENCY, nullrt, mtdm->_err);
+        mtdm_clear(mtdm);
+        if (e) {
+            nullrt = 0;
+            nullrun = false;
+            nullarmed = false;
+            post_error(e);
+            requestParameterValueChange((PortIndex)NULLTEST, 0.0f);
+            return;
+        }
+    }
+
     // measure roundtrip latency, running 128 frames
     if (iSlow0 && !roundtrip) {
         mtdm_process (mtdm, count, input0, output0);
         measure++;
-        if (measure < 128) return;
+        if (measure < 128 && !(ffast > 0.5f && confirm_latency(measure * count))) return;
+        capfast = measure < 128;
     }
     // resolve roundtrip latency after 128 frames
     if (measure && !roundtrip) {
-        // no signal comes in, stop the process here
-        if (mtdm_resolve (mtdm) < 0) {
+        // set roundtrip latency, on no signal, garbage or a missing input file stop the process here
+        int e = resolve_latency(&roundtrip);
+        if (!e && !inputsize) e = 4;
+        if (e) {
             roundtrip = 0;
             measure = 0;
             finish = 1;
-            errors = 1.0;
-            setOutputParameterValue(ERRORS, errors);
+            post_error(e);
             requestParameterValueChange((PortIndex)PROFILE, 0.0f);
-            //fprintf (stderr, "no signal comes in, stop the process here\n");
             return;
         }
-        // when phase is inverted resolve with inverted frames
-        if (mtdm->_err > 0.3) {
-            mtdm_invert ( mtdm );
-            mtdm_resolve ( mtdm );
-        }
-        // set roundtrip latency
-        roundtrip = mtdm->_del;
+        caplatency = roundtrip;
+        // remember the confirmed latency for this samplerate and buffer size
+        confirmederr.store(mtdm->_err, std::memory_order_relaxed);
+        confirmedrt.store(roundtrip, std::memory_order_release);
+        knownrt.store(roundtrip, std::memory_order_relaxed);
+        post_event(EV_LATENCY, roundtrip, mtdm->_err);
         // printf ("roundtrip latency is %i\n", roundtrip);
 
-        // seems we receive garbage, stop the process here
-        if (mtdm->_err > 0.2) {
-            roundtrip = 0;
-            measure = 0;
-            finish = 1;
-            errors = 2.0;
-            setOutputParameterValue(ERRORS, errors);
-            requestParameterValueChange((PortIndex)PROFILE, 0.0f);
-            //fprintf (stderr, "seems we receive garbage, stop the process here\n");
-            return;
-        }
-        if (!inputsize) {
-            roundtrip = 0;
-            measure = 0;
-            finish = 1;
-            errors = 4.0;
-            setOutputParameterValue(ERRORS, errors);
-            requestParameterValueChange((PortIndex)PROFILE, 0.0f);
-            return;
-        }
         // clear the roundtrip measurement struct
         mtdm_clear(mtdm);
+        overruns = 0;
+        clipped = false;
+        // reset the peak levels for this take
+        fConst1 = 0.1;
+        fConst2 = 0.1;
+        nf = 1.0;
+        // the number of passes to average, the roundtrip latency is measured once for all
+        pass = 0;
+        npasses = fmin(MAXPASSES, fmax(1, int(fpasses)));
+        // resume a interrupted take from the last committed frame minus a 100ms overlap
+        resumeoffset = 0;
+        if (npasses == 1 && fresume > 0.5f && seqstate.load(std::memory_order_relaxed) == SQ_IDLE &&
+            resumeframes.load(std::memory_order_acquire) > 0) {
+            resumeoffset = fmin(inputsize, fmax(0, resumeframes - fSamplingFreq / 10));
+            IOTAP = resumeoffset;
+            fConst1 = resumepeak;
+            fConst2 = resumeinpeak;
+            // a resumed take keeps the trim it was started with
+            intrim = resumetrim;
+        } else if (fcalib > 0.5f && callen) {
+            // play the level stepped burst first
+            calpos = 0;
+            intrim = 1.0;
+        } else {
+            intrim = 1.0;
+            calibrated = false;
+        }
+        // the reference input is recorded along for single pass takes which start from zero
+        refmode = (input1 && npasses == 1 && !resumeoffset) ? int(fmin(2.0f, fmax(0.0f, freference)) + 0.5f) : 0;
+        wave_start();
     }
     for (int i=0; i<count; i++) {
         // default output is zero
@@ -649,23 +3040,43 @@ void always_inline Profil::compute(int count, const float *input0, float *output
         iRecb1[0] = ((iTemp1)?(1 + iRecb1[1]):1);
         fRecb2[0] = ((iTemp1)?fRecb2[1]:fRecb0[1]);
         
-        if (iSlow0) { //record
+        if (iSlow0 && calpos >= 0) { // level calibration before the capture
+            fTemp0 = calibrate_sample(fTemp1);
+            if (finish) iSlow0 = 0;
+        } else if (iSlow0) { //record
             // delay recording by measured rountrip latency
             if  (latency > roundtrip) {
+                float fTemp2 = fTemp1 * intrim;
+                // the reference is kept raw, at the same position as the target
+                if (refmode) (iA ? fRef1 : fRef0)[IOTA] = input1 ? input1[i] : 0.0f;
                 if (iA) {
-                    fRec1[IOTA++] = fTemp1;
+                    fRec1[IOTA++] = fTemp2;
                 } else {
-                    fRec0[IOTA++] = fTemp1;
+                    fRec0[IOTA++] = fTemp2;
                 }
                 time_match = false;
-                fConst1 = fmax(fConst1, fabsf(fTemp1));
+                fConst1 = fmax(fConst1, fabsf(fTemp2));
+                wave_sample(fTemp2, resumeoffset + latency - roundtrip - 1);
+                // the trimmed target went above full scale, it's clipped on disk, so stop the take.
+                // The needed reduction is guessed from the gain so far at the stimulus peak.
+                if (fConst1 > 1.0f && !clipped) {
+                    clipped = true;
+                    headroom = -20.0 * log10(fmax(fConst1, fConst1 * stimpeak / fConst2));
+                    post_error(9.0, headroom);
+                    requestParameterValueChange((PortIndex)PROFILE, 0.0f);
+                }
             }
             if (IOTA > MAXRECSIZE-1) { // when buffer is full, flush to stream
+                // the worker didn't save the last chunk in time, it get lost
+                if (chunkwake.load(std::memory_order_acquire))
+                    post_event(EV_OVERRUN, ++overruns, 0.0);
                 iA = iA ? 0 : 1 ;
                 tape = iA ? fRec0 : fRec1;
+                reftape = iA ? fRef0 : fRef1;
                 keep_stream = true;
                 savesize = IOTA;
-                worker.cv.notify_one();
+                chunkwake.store(true, std::memory_order_release);
+                worker.notify();
                 IOTA = 0;
             }
             // play input.wav file once
@@ -676,7 +3087,12 @@ void always_inline Profil::compute(int count, const float *input0, float *output
             }
             latency++;
             // switch of recording when record time match play time
-            if (latency > (inputsize + roundtrip)) {
+            if (latency > (inputsize - resumeoffset + roundtrip) && ++pass < npasses) {
+                // start the next pass, keep the measured roundtrip latency
+                IOTAP = 0;
+                latency = 0;
+                wave_start();
+            } else if (latency > (inputsize - resumeoffset + roundtrip)) {
                 finish = 1;
                 IOTAP = 0;
                 latency = 0;
@@ -694,11 +3110,16 @@ void always_inline Profil::compute(int count, const float *input0, float *output
                 //fprintf(stderr, "finished max %f \n", nf);
             }
             
+        } else if (nullrun) { // null test
+            fTemp0 = null_sample(fTemp1);
         } else if (IOTA) { // when record stoped, flush the rest to stream
             tape = iA ? fRec1 : fRec0;
+            reftape = iA ? fRef1 : fRef0;
             savesize = IOTA;
             keep_stream = false;
-            worker.cv.notify_one();
+            flushing.store(true, std::memory_order_release);
+            chunkwake.store(true, std::memory_order_release);
+            worker.notify();
             IOTA = 0;
             iA = 0;
             IOTAP = 0;
@@ -712,38 +3133,33 @@ void always_inline Profil::compute(int count, const float *input0, float *output
         iRecb1[1] = iRecb1[0];
         fRecb0[1] = fRecb0[0];
     }
-    // peek-meter, when the level fails below threshold trigger a little variance every 12 circle
-    // that reduce the I/O trafic but ensure that the value cross the event throttle boarder.
-    // This is needed because the peek-meter use a falloff offset for smoother display the level.
-    if (fRecb2[0] < fRef) {
-        if (iRefSet > 12) {
-            iRef = !iRef;
-            fRef = iRef ? 0.0000003 : 0.00000031;
-        } else {
-            iRefSet++;
-        }
-     } else {
-         iRefSet = 0;
-     }
-     fbargraph = 20.*log10(fmax(fRef,fRecb2[0]));
+    // peek-meter, the UI let the meter fall off by itself
+     fbargraph = 20.*log10(fmax(0.0000003, fRecb2[0])); // -130db
      setOutputParameterValue(METER, fbargraph);
     // progress bar
-     if (inputsize)
-        fbargraph1 = finish ? 1.0 : float(float(IOTAP) / float(inputsize));
+     if (nullrun)
+        fbargraph1 = float(nullpos) / inputsize;
+     else if (inputsize)
+        fbargraph1 = finish ? 1.0 : float(float(pass) * inputsize + IOTAP) / (float(npasses) * inputsize);
      else
         fbargraph1 = 0.0;
      setOutputParameterValue(STATE, fbargraph1);
-     reset_errors++;
-     // rest error number to ensure we could show the same error again when needed
-     if (reset_errors > 2000) {
-         reset_errors = 0;
+     // a error stays on the port for a second, so hosts which poll the port see it,
+     // then it is cleared once, so the same error could be shown again
+     if (errors != 0.0 && (reset_errors += count) > fSamplingFreq) {
+         errors = 0.0;
          setOutputParameterValue(ERRORS, errors);
      }
 }
 
 // static wrapper to run the process
 void Profil::mono_audio(int count, const float *input0, float *output0, Profil *p) {
-    (p)->compute(count, input0, output0);
+    (p)->compute(count, input0, NULL, output0);
+}
+
+// static wrapper to run the process with the reference input
+void Profil::ref_audio(int count, const float *input0, const float *input1, float *output0, Profil *p) {
+    (p)->compute(count, input0, input1, output0);
 }
 
 // connect parameters with ports from the host
@@ -753,6 +3169,45 @@ void Profil::connect(uint32_t port, float data) {
     case PROFILE: 
         fcheckbox0 = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
         break;
+    case RESUME: 
+        fresume = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case PASSES: 
+        fpasses = data; // , 1.0f, 1.0f, 8.0f, 1.0f 
+        break;
+    case REJECT: 
+        freject = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case EXPORT: 
+        fexport = data; // , 0.0f, 0.0f, 2.0f, 1.0f 
+        break;
+    case SPLIT: 
+        fsplit = data; // , 0.0f, 0.0f, 50.0f, 1.0f 
+        break;
+    case NULLTEST: 
+        fnull = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case CALIBRATE: 
+        fcalib = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case SEQUENCE: 
+        fseq = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case SETTLE: 
+        fsettle = data; // , 2.0f, 0.0f, 30.0f, 0.1f 
+        break;
+    case FASTSTART: 
+        ffast = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case FORMAT: 
+        fformat = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
+        break;
+    case STIMULUS: 
+        fstimulus = data; // , 0.0f, 0.0f, 99.0f, 1.0f 
+        break;
+    case REFERENCE: 
+        freference = data; // , 0.0f, 0.0f, 2.0f, 1.0f 
+        break;
     case CLIP: 
         fcheckbox1 = data; // , 0.0f, 0.0f, 1.0f, 1.0f 
         break;
@@ -775,6 +3230,82 @@ void Profil::connect_ports(uint32_t port,float data, Profil *p) {
     (p)->connect(port, data);
 }
 
+// block until the worker finished all work which is signaled,
+// used when the process runs offline faster than real time
+void Profil::sync_worker(Profil *p) {
+    while (p->chunkwake.load(std::memory_order_acquire) || p->seqwake.load(std::memory_order_acquire))
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    p->worker.sync();
+}
+
+// name the next take like a queued one, the value goes into the filename and the capture index
+void Profil::label_take(const std::string& key, const std::string& value, Profil *p) {
+    SeqTake take;
+    take.settle = 0.0;
+    take.params.push_back(std::make_pair(key, value));
+    p->seqtakes.assign(1, take);
+    p->seqcur.store(0, std::memory_order_release);
+}
+
+// play another stimulus instead of input.wav, used from the next activation on
+void Profil::set_stimulus(const std::string& fname, Profil *p) {
+    p->stimulusfile = fname;
+}
+
+// the names of the stimulus library, the STIMULUS port select index + 1
+std::vector<std::string> Profil::stimulus_library(Profil *p) {
+    return p->stimulus_list();
+}
+
+// the number of helper threads for the post processing, 0 runs it on the worker alone
+void Profil::set_pool_threads(int threads) {
+    pool().resize(threads);
+}
+
+// the folder were the captures and the capture index are saved
+std::string Profil::profile_path(Profil *p) {
+    return p->get_path();
+}
+
+// the buffer size is part of the key of the stored latency, set it while deactivated
+void Profil::set_buffersize(int frames, Profil *p) {
+    std::lock_guard<std::mutex> lk(p->latmutex);
+    p->latency_merge();
+    p->blocksize = frames;
+}
+
+// the stored latencies as "rate:frames:latency:err" entries, separated by ';'
+std::string Profil::latency_state(Profil *p) {
+    std::lock_guard<std::mutex> lk(p->latmutex);
+    p->latency_merge();
+    std::ostringstream ss;
+    ss.imbue(std::locale::classic());
+    for (size_t i = 0; i < p->latcal.size(); i++)
+        ss << (i ? ";" : "") << p->latcal[i].rate << ":" << p->latcal[i].frames << ":"
+           << p->latcal[i].latency << ":" << p->latcal[i].err;
+    return ss.str();
+}
+
+// load the stored latencies
+void Profil::restore_latency(const std::string& state, Profil *p) {
+    {
+        std::lock_guard<std::mutex> lk(p->latmutex);
+        p->latcal.clear();
+        p->confirmedrt.store(0);
+        std::string entry;
+        std::istringstream ss(state);
+        while (std::getline(ss, entry, ';')) {
+            std::replace(entry.begin(), entry.end(), ':', ' ');
+            std::istringstream es(entry);
+            es.imbue(std::locale::classic());
+            LatencyCal c;
+            if ((es >> c.rate >> c.frames >> c.latency >> c.err) && c.latency > 0)
+                p->latcal.push_back(c);
+        }
+    }
+    p->latency_lookup();
+}
+
 // delete the plug
 void Profil::delete_instance(Profil *p) {
     delete (p);
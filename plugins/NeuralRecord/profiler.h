@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <dirent.h>
 
 #include <iomanip>
 #include <sstream>
@@ -37,26 +38,49 @@
 
 #include <sndfile.hh>
 
+#include "fft.h"
+#include "kernels.h"
+
 #include <libgen.h>
 #include <stdio.h>
 
 #if defined(WIN32) || defined(_WIN32)
 #include <windows.h>
+#include <io.h>
+#include <share.h>
 #else
 #include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #endif
 
 #include <fstream>
 #include <functional>
+#include <algorithm>
+#include <vector>
+#include <locale>
+#include <cstdint>
 
 #include <atomic>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 
 
 namespace profiler {
 
+#define MAXPASSES 8
+#define NULLRING 131072  // read ahead ring for the null test, power of two
+#define CALSTEPS 5       // level steps of the calibration burst
+#define FASTERR 0.1      // max mtdm error to accept a stored latency on fast start
+#define WAVEBIN 256      // recorded samples summed up in one bin of the waveform overview
+#define WAVERING 4096    // bins in the waveform ring, power of two
+#define SPECSIZE 2048    // samples of a spectrum block, power of two
+#define SPECRING 8       // blocks in the spectrum ring, power of two
+#define EVENTRING 64     // status events in the event ring, power of two
+#define STIMCACHE 2      // version of the stimulus cache format
+
 
 struct Freq
 {
@@ -76,17 +100,251 @@ struct MTDM
     double  _del;
     double  _err;
     float   _wlp;
+    const float *_sin;
     int     _cnt;
     int     _inv;
 
     struct Freq _freq [13];
 };
 
+// a discontinuity found in the recorded stream, shift is the lag change in samples,
+// or zero when the signal got lost for length samples
+struct DropOut
+{
+    int   position;
+    int   shift;
+    int   length;
+};
+
+// a confirmed roundtrip latency, kept per samplerate and buffer size
+struct LatencyCal
+{
+    int   rate;
+    int   frames;
+    int   latency;
+    float err;
+};
+
+// a midi message send to the device before a take
+struct SeqMidi
+{
+    uint8_t size;
+    uint8_t data[3];
+};
+
+// one line of the capture queue: the midi messages to send, the settle time
+// and the parameter values which go into the filename and the capture index
+struct SeqTake
+{
+    std::vector<SeqMidi> midi;
+    std::vector<std::pair<std::string, std::string> > params;
+    float settle;
+};
+
+// a silent region of the stimulus, or a region of a take which was skipped
+// while recording, both in frames
+struct SilentRun
+{
+    int64_t start;
+    int64_t length;
+};
+
+// a stimulus ready to play, mapped from the cache or decoded into memory
+struct Stimulus
+{
+    float       *data;
+    int64_t     size;      // samples, all channels
+    uint64_t    hash;      // FNV-1a over the samples
+    float       peak;
+    int64_t     peakpos;
+    size_t      mapped;    // bytes of the mapping, zero when data is on the heap
+    std::string file;
+    std::vector<SilentRun> silence;
+    Stimulus() : data(NULL), size(0), hash(0), peak(0.0), peakpos(0), mapped(0) {}
+};
+
+// header of a cached stimulus, followed by the raw float samples and the silent runs.
+// The size and the modification time of the source invalidate the cache when the
+// source file changes.
+struct StimCacheHeader
+{
+    char        magic[8];  // "NRSTIM\0\0"
+    uint32_t    version;
+    uint32_t    channels;
+    uint32_t    samplerate;
+    float       peak;
+    int64_t     srcsize;
+    int64_t     srcmtime;
+    int64_t     samples;
+    uint64_t    hash;
+    int64_t     peakpos;
+    int64_t     runs;      // silent runs after the samples
+};
+
+// min/max of WAVEBIN samples of the target and the stimulus at the same take position,
+// a bin with a negative position starts a new take of length bins
+struct WaveBin
+{
+    int   pos;
+    int   length;
+    float tmin;
+    float tmax;
+    float smin;
+    float smax;
+};
+
+// single producer single consumer ring, the audio thread push the waveform bins,
+// the UI pull them. When nobody reads, the ring runs full and new bins are dropped.
+class WaveRing {
+private:
+    WaveBin ring[WAVERING];
+    std::atomic<uint32_t> wpos;
+    std::atomic<uint32_t> rpos;
+    std::atomic<bool> want;
+
+public:
+    WaveRing() : wpos(0), rpos(0), want(false) {}
+
+    inline bool push(const WaveBin& bin) {
+        const uint32_t w = wpos.load(std::memory_order_relaxed);
+        if (w - rpos.load(std::memory_order_acquire) >= WAVERING) return false;
+        ring[w & (WAVERING-1)] = bin;
+        wpos.store(w + 1, std::memory_order_release);
+        return true;
+    }
+
+    inline int pull(WaveBin *bins, int max) {
+        const uint32_t r = rpos.load(std::memory_order_relaxed);
+        const int n = std::min(int(wpos.load(std::memory_order_acquire) - r), max);
+        for (int i = 0; i < n; i++) bins[i] = ring[(r + i) & (WAVERING-1)];
+        rpos.store(r + n, std::memory_order_release);
+        return n;
+    }
+
+    // the reader side, drop what was queued while nobody read the ring
+    // and ask the recorder for a new start marker of the running take
+    inline void resync() {
+        rpos.store(wpos.load(std::memory_order_acquire), std::memory_order_release);
+        want.store(true, std::memory_order_release);
+    }
+
+    inline bool resync_wanted() const { return want.load(std::memory_order_acquire); }
+    inline void resynced() { want.store(false, std::memory_order_release); }
+};
+
+// a block of the stimulus and the target at the same take position, for the spectrum view
+struct SpecBlock
+{
+    float stim[SPECSIZE];
+    float target[SPECSIZE];
+};
+
+// wait free block ring, the audio thread fill the block at the write position in place
+// and publish it when full, the UI read the block at the read position and pop it.
+// A block only starts when a slot is free, so each block holds contiguous samples.
+class SpecRing {
+private:
+    SpecBlock ring[SPECRING];
+    std::atomic<uint32_t> wpos;
+    std::atomic<uint32_t> rpos;
+    int fill;
+
+public:
+    SpecRing() : wpos(0), rpos(0), fill(0) {}
+
+    inline void write(float s, float t) {
+        const uint32_t w = wpos.load(std::memory_order_relaxed);
+        if (!fill && w - rpos.load(std::memory_order_acquire) >= SPECRING) return;
+        SpecBlock& b = ring[w & (SPECRING-1)];
+        b.stim[fill] = s;
+        b.target[fill] = t;
+        if (++fill == SPECSIZE) {
+            fill = 0;
+            wpos.store(w + 1, std::memory_order_release);
+        }
+    }
+
+    inline const SpecBlock* front() {
+        const uint32_t r = rpos.load(std::memory_order_relaxed);
+        if (wpos.load(std::memory_order_acquire) == r) return nullptr;
+        return &ring[r & (SPECRING-1)];
+    }
+
+    inline void pop() {
+        rpos.store(rpos.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+// the kind of a status event
+typedef enum
+{
+   EV_ERROR,     // code is the error number, value the headroom for a clipping input
+   EV_LATENCY,   // code is the roundtrip latency in samples, value the mtdm error
+   EV_CAPTURE,   // code is the capture index, value the normalisation factor, text the file
+   EV_OVERRUN,   // code is the number of chunks the worker lost in this take
+} StatusType;
+
+// a status event, emitted once when something changed, time is seconds since the epoch
+struct StatusEvent
+{
+    int    type;
+    int    code;
+    float  value;
+    double time;
+    char   text[256];
+};
+
+// bounded multi producer single consumer ring, the audio thread and the worker post
+// status events, the UI (or the daemon) pop them. Each cell carries a sequence number,
+// a producer claims a cell by moving the write position, when the ring is full the
+// event is dropped.
+class StatusRing {
+private:
+    struct Cell {
+        std::atomic<uint32_t> seq;
+        StatusEvent ev;
+    };
+    Cell cells[EVENTRING];
+    std::atomic<uint32_t> wpos;
+    std::atomic<uint32_t> rpos;
+
+public:
+    StatusRing() : wpos(0), rpos(0) {
+        for (uint32_t i = 0; i < EVENTRING; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    inline bool push(const StatusEvent& ev) {
+        uint32_t pos = wpos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& c = cells[pos & (EVENTRING-1)];
+            const int32_t dif = int32_t(c.seq.load(std::memory_order_acquire) - pos);
+            if (dif < 0) return false;
+            if (dif == 0 && wpos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                c.ev = ev;
+                c.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+            if (dif > 0) pos = wpos.load(std::memory_order_relaxed);
+        }
+    }
+
+    inline bool pop(StatusEvent& ev) {
+        const uint32_t pos = rpos.load(std::memory_order_relaxed);
+        Cell& c = cells[pos & (EVENTRING-1)];
+        if (int32_t(c.seq.load(std::memory_order_acquire) - (pos + 1)) < 0) return false;
+        ev = c.ev;
+        c.seq.store(pos + EVENTRING, std::memory_order_release);
+        rpos.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+};
+
 class Profil;
 
 class ProfilWorker {
 private:
     std::atomic<bool> _execute;
+    std::atomic<bool> _pending;
     std::thread _thd;
     std::mutex m;
 
@@ -94,40 +352,197 @@ public:
     ProfilWorker();
     ~ProfilWorker();
     void stop();
+    void sync();
     void start(Profil *pt);
+    void notify();
     bool is_running() const noexcept;
     std::condition_variable cv;
 };
 
+// helper threads for the post processing, shared by all instances. A stage is split
+// in tasks, which the pool threads and the calling worker pick up. The pool runs one
+// stage at a time, a other instance runs its stage inline meanwhile.
+class ProfilPool {
+private:
+    std::vector<std::thread> _thds;
+    std::mutex m;
+    std::mutex stage;
+    std::condition_variable cv;
+    std::condition_variable done;
+    const std::function<void(int)> *_job;
+    int _tasks;
+    std::atomic<int> _next;
+    int _left;
+    int _busy;
+    unsigned _gen;
+    int _threads;
+    bool _stop;
+    void loop();
+    void stop();
+    int  drain(const std::function<void(int)>& f, int tasks);
+
+public:
+    ProfilPool();
+    ~ProfilPool();
+    void resize(int threads);
+    void parallel(int tasks, const std::function<void(int)>& f);
+};
+
 class Profil {
 private:
     SNDFILE *       recfile;
     SNDFILE *       playfile;
+    SNDFILE *       nullsf;
+    SNDFILE *       reffile;
+    FILE *          journal;
     std::string     inputfile;
+    std::string     stimulusfile;
     std::string     outputfile;
+    std::string     profilepath;
+    std::string     journalfile;
+    std::string     resumefile;
+    std::string     exportdir;
+    std::string     nullfile;
+    std::string     refname;
     struct MTDM     *mtdm;
     ProfilWorker    worker;
     int             fSamplingFreq;
     int             channel;
     float           fcheckbox0;
     float           fcheckbox1;
+    float           fresume;
+    float           fpasses;
+    float           freject;
+    float           fexport;
+    float           fsplit;
+    float           fnull;
+    float           fcalib;
+    float           fseq;
+    float           fsettle;
+    float           ffast;
+    float           fformat;
+    float           freference;
     float           fbargraph;
     float           fbargraph1;
     float           errors;
     int             reset_errors;
-    int             latency;
+    int             overruns;
+    int64_t         latency;
     int             roundtrip;
     int             measure;
     int             finish;
     int             IOTA;
-    int             IOTAP;
+    int64_t         IOTAP;
     int             iA;
     int             savesize;
-    int             filesize;
-    int             inputsize;
+    int64_t         filesize;
+    int64_t         skipped;
+    int64_t         inputsize;
+    int             unsynced;
+    std::chrono::steady_clock::time_point synctime;
+    int             nextindex;
+    int             capindex;
+    int             caplatency;
+    bool            capfast;
+    bool            flacout;
+    bool            rf64out;
+    bool            silentout;
+    int             refmode;
+    int             reflatency;
+    bool            refcorrected;
+    int             blocksize;
+    std::vector<LatencyCal> latcal;
+    std::mutex      latmutex;
+    std::atomic<int> knownrt;
+    std::atomic<int> confirmedrt;
+    std::atomic<float> confirmederr;
+    uint64_t        stimulushash;
+    std::atomic<int64_t> resumeframes;
+    int64_t         resumeoffset;
+    int             resumeindex;
+    float           resumepeak;
+    float           resumeinpeak;
+    float           stitchcorr;
+    int             npasses;
+    int             pass;
+    int64_t         passpos;
+    int             passcount;
+    int             accepted;
+    float           passcorr[MAXPASSES];
+    float           *avgbuf;
+    float           *passbuf;
+    float           driftppm;
+    bool            driftfixed;
+    std::vector<DropOut> dropouts;
+    std::atomic<bool> chunkwake;
+    std::atomic<int> nullstate;
+    std::atomic<bool> nullwake;
+    std::atomic<uint32_t> nullwrite;
+    std::atomic<uint32_t> nullread;
+    float           *nullring;
+    float           nullgain;
+    bool            nullarmed;
+    bool            nullrun;
+    int             nullrt;
+    int             nullmeasure;
+    int64_t         nullpos;
+    int64_t         nulllatency;
+    int             nullcount;
+    double          nullerr;
+    double          nullsig;
+    double          nullerrsum;
+    double          nullsigsum;
+    float           *fitbuf;
+    float           *fitwin;
+    std::complex<float> *fitspec;
+    double          *fitacc;
+    int             fitfill;
+    int64_t         fitpos;
+    float           fitesr;
+    int             calpos;
+    int             callen;
+    int             calstart;
+    float           calpeak[CALSTEPS];
+    float           stimpeak;
+    int64_t         stimpeakpos;
+    std::vector<SilentRun> stimsilence;
+    std::vector<SilentRun> silentskip;
+    size_t          silentcur;
+    size_t          tapemap;
+    float           fstimulus;
+    int             stimindex;
+    int             stimwant;
+    Stimulus        stimnext;
+    std::atomic<int> stimstate;
+    std::atomic<bool> stimwake;
+    float           intrim;
+    float           resumetrim;
+    float           headroom;
+    bool            calibrated;
+    bool            clipped;
+    WaveRing        wave;
+    SpecRing        spec;
+    StatusRing      events;
+    WaveBin         wavebin;
+    int             wavefill;
+    std::vector<SeqTake> seqtakes;
+    std::atomic<int> seqstate;
+    std::atomic<bool> seqwake;
+    std::atomic<bool> flushing;
+    std::atomic<int> seqcur;
+    int             seqtake;
+    int             seqwait;
+    bool            seqarmed;
+    int             seqopen;
+    bool            seqqueued;
+    std::string     seqname;
+    std::string     seqparams;
     float           *fRec0;
     float           *fRec1;
+    float           *fRef0;
+    float           *fRef1;
     float           *tape;
+    float           *reftape;
     float           *tape1;
     volatile bool   keep_stream;
     bool            mem_allocated;
@@ -143,29 +558,77 @@ private:
     float           fRecb0r[2];
     int             iRecb1r[2];
     float           fRecb2r[2];
-    int             iRef;
-    int             iRefSet;
-    float           fRef;
 
     void        mem_alloc();
     void        mem_free();
     void        clear_state_f();
     int         activate(bool start);
     void        init(unsigned int samplingFreq);
-    void        compute(int count, const float *input0, float *output0);
-    void        save_to_wave(SNDFILE * sf, float *tape, int lSize);
+    void        compute(int count, const float *input0, const float *input1, float *output0);
+    void        save_to_wave(SNDFILE * sf, float *tape, int64_t lSize);
+    void        save_active(float *buf, int n, int64_t pos);
     SNDFILE     *open_stream(std::string fname);
     void        close_stream(SNDFILE **sf);
     void        disc_stream();
+    void        open_journal();
+    void        commit_journal();
+    void        close_journal();
+    void        recover_captures();
+    void        resume_stream();
+    void        finish_stream();
+    void        average_stream();
+    void        finish_pass();
     void        connect(uint32_t port, float data);
-    void        normalize();
-    inline int  load_from_wave(std::string fname);
+    void        normalize(float *buf, int n);
+    bool        post_process();
+    bool        compensate_drift(float *buf, int n);
+    void        detect_dropouts(const float *buf, int n);
+    void        write_dropouts();
+    void        export_take(const float *buf, int n, const float *ref);
+    void        open_reference();
+    bool        reference_process(float *buf, int n, const float *ref);
+    int         resolve_latency(int *lat);
+    bool        confirm_latency(int frames);
+    void        latency_merge();
+    void        latency_lookup();
+    bool        null_control(bool busy);
+    void        null_stream();
+    void        null_fill();
+    void        null_report(double e, double s);
+    inline float null_sample(float in);
+    void        fit_reset();
+    void        fit_chunk(const float *buf, int n, int64_t pos);
+    void        fit_frame(int64_t start);
+    void        fit_report();
+    void        calibrate_init();
+    inline float calibrate_sample(float in);
+    void        calibrate_finish();
+    void        post_event(int type, int code, float value, const std::string& text = std::string());
+    void        post_error(float e, float value = 0.0);
+    void        wave_start();
+    inline void wave_sample(float t, int64_t pos);
+    void        sequence_stream();
+    inline int  sequence_control(int count);
+    void        sequence_stop();
+    void        sequence_open();
+    void        load_index();
+    void        write_index();
     inline void  convert_to_wave(std::string fname, std::string oname);
     inline std::string get_path(); 
     inline std::string get_ffilename(); 
     inline std::string get_ifilename(); 
+    std::vector<std::string> stimulus_list();
+    std::string stimulus_file(int index);
+    std::string stimulus_cache(const std::string& fname);
+    bool        load_stimulus(const std::string& fname, Stimulus& s);
+    bool        map_stimulus(const std::string& cname, const struct stat& sb, Stimulus& s);
+    void        free_stimulus(Stimulus& s);
+    void        swap_stimulus(Stimulus& s);
+    inline bool stimulus_control(bool busy);
+    void        stimulus_stream();
     std::function<void(const uint32_t, float) > setOutputParameterValue;
     std::function<void(const uint32_t, float) > requestParameterValueChange;
+    std::function<bool(const uint32_t, const uint8_t*, const uint32_t) > writeMidiEvent;
 
 public:
     static void run_thread(void* p);
@@ -173,10 +636,25 @@ public:
     static int  activate_plugin(bool start, Profil*);
     static void set_samplerate(unsigned int samplingFreq, Profil*);
     static void mono_audio(int count, const float *input0, float *output0, Profil*);
+    static void ref_audio(int count, const float *input0, const float *input1, float *output0, Profil*);
     static void delete_instance(Profil *p);
     static void connect_ports(uint32_t port, float data, Profil *p);
+    static void sync_worker(Profil *p);
+    static void label_take(const std::string& key, const std::string& value, Profil *p);
+    static void set_stimulus(const std::string& fname, Profil *p);
+    static void set_pool_threads(int threads);
+    static std::vector<std::string> stimulus_library(Profil *p);
+    static std::string profile_path(Profil *p);
+    static void set_buffersize(int frames, Profil *p);
+    static std::string latency_state(Profil *p);
+    static void restore_latency(const std::string& state, Profil *p);
+    // inline, the UI reads the ring through the plugin instance
+    static WaveRing* wave_ring(Profil *p) { return &p->wave; }
+    static SpecRing* spec_ring(Profil *p) { return &p->spec; }
+    static StatusRing* status_ring(Profil *p) { return &p->events; }
     Profil(int channel_, std::function<void(const uint32_t , float) > setOutputParameterValue_,
-                         std::function<void(const uint32_t , float) > requestParameterValueChange_);
+                         std::function<void(const uint32_t , float) > requestParameterValueChange_,
+                         std::function<bool(const uint32_t, const uint8_t*, const uint32_t) > writeMidiEvent_);
     ~Profil();
 };
 
@@ -0,0 +1,456 @@
+/*
+ * Neural Record Daemon, headless JACK capture with the Neural Record profiler
+ *
+ * SPDX-License-Identifier:  GPL-2.0 license
+ *
+ * Copyright (C) 2023 brummer <brummer@web.de>
+ */
+
+// A capture box in a rack has no screen and no one to press the button. The daemon runs the
+// profiler as a plain JACK client, the process callback is the same Profil::ref_audio() the
+// plug runs, connects itself to the physical ports and is controlled over a local UNIX socket.
+// The reference input (the interface loopback) is only connected when given with -r.
+// Commands are text lines, answers and the status stream are JSON lines:
+//
+//   start | stop | null | sequence     capture, null test, run the sequence.txt queue
+//   set <control> <value>              resume, passes, reject, export, split, calibrate, settle, faststart,
+//                                      format, stimulus (the index in the stimulus library),
+//                                      reference (0 off, 1 export, 2 correct)
+//   stimulus <file>                    play another stimulus than input.wav (only while idle)
+//   stimuli                            list the stimulus library
+//   status                             one status line
+//   watch on|off                       stream the status ten times a second, and the events
+//                                      (error, latency, capture, overrun) when they happen
+//   captures                           list the entries of captures.jsonl
+//   quit                               close the connection
+
+#include "profiler.cc"
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define WATCHRATE 100  // ms between two status lines
+
+// --------------------------------------------------------------------------------
+
+// the input controls a client could set, with the port they belong to
+static const struct { const char *name; profiler::PortIndex port; } controls[] = {
+    { "resume",    profiler::RESUME },
+    { "passes",    profiler::PASSES },
+    { "reject",    profiler::REJECT },
+    { "export",    profiler::EXPORT },
+    { "split",     profiler::SPLIT },
+    { "calibrate", profiler::CALIBRATE },
+    { "settle",    profiler::SETTLE },
+    { "faststart", profiler::FASTSTART },
+    { "format",    profiler::FORMAT },
+    { "stimulus",  profiler::STIMULUS },
+    { "reference", profiler::REFERENCE },
+};
+
+// one connected client
+struct Client
+{
+    int         fd;
+    bool        watch;
+    std::string line;
+};
+
+static jack_client_t *client = NULL;
+static jack_port_t *inport = NULL;
+static jack_port_t *refport = NULL;
+static jack_port_t *outport = NULL;
+static jack_port_t *midiport = NULL;
+static void *midibuf = NULL;
+static profiler::Profil *plug = NULL;
+static std::string capturename;
+static std::string playbackname;
+static std::string referencename;
+
+// the output values of the profiler, written from the process callback
+static std::atomic<float> values[profiler::CLIP];
+// switches the profiler asks to release, handled outside of the process callback
+static std::atomic<bool> release[profiler::CLIP];
+static volatile sig_atomic_t quit = 0;
+
+// --------------------------------------------------------------------------------
+
+static int process(jack_nframes_t nframes, void *) {
+    const float *in = static_cast<const float*>(jack_port_get_buffer(inport, nframes));
+    const float *ref = static_cast<const float*>(jack_port_get_buffer(refport, nframes));
+    float *out = static_cast<float*>(jack_port_get_buffer(outport, nframes));
+    midibuf = jack_port_get_buffer(midiport, nframes);
+    jack_midi_clear_buffer(midibuf);
+    profiler::Profil::ref_audio(nframes, in, ref, out, plug);
+    midibuf = NULL;
+    return 0;
+}
+
+static void shutdown(void *) {
+    quit = 1;
+}
+
+static void on_signal(int) {
+    quit = 1;
+}
+
+// connect to the given ports, or to the first physical ones
+static void auto_connect() {
+    const char **ports = NULL;
+    std::string src = capturename;
+    if (src.empty() && (ports = jack_get_ports(client, NULL, JACK_DEFAULT_AUDIO_TYPE,
+                                               JackPortIsPhysical | JackPortIsOutput)) && ports[0])
+        src = ports[0];
+    if (ports) jack_free(ports);
+    ports = NULL;
+    std::string dst = playbackname;
+    if (dst.empty() && (ports = jack_get_ports(client, NULL, JACK_DEFAULT_AUDIO_TYPE,
+                                               JackPortIsPhysical | JackPortIsInput)) && ports[0])
+        dst = ports[0];
+    if (ports) jack_free(ports);
+    if (src.empty() || jack_connect(client, src.c_str(), jack_port_name(inport)))
+        fprintf(stderr, "neuralrecordd: could not connect the input to %s\n", src.c_str());
+    if (dst.empty() || jack_connect(client, jack_port_name(outport), dst.c_str()))
+        fprintf(stderr, "neuralrecordd: could not connect the output to %s\n", dst.c_str());
+    if (!referencename.empty() && jack_connect(client, referencename.c_str(), jack_port_name(refport)))
+        fprintf(stderr, "neuralrecordd: could not connect the reference to %s\n", referencename.c_str());
+}
+
+// --------------------------------------------------------------------------------
+
+static void send_line(Client& c, const std::string& s) {
+    std::string l = s + "\n";
+    // a client which doesn't read gets dropped, the daemon never waits for it
+    if (send(c.fd, l.c_str(), l.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)l.size()) {
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+static std::string status_line() {
+    std::ostringstream os;
+    os << "{\"event\":\"status\""
+       << ",\"capture\":" << (values[profiler::PROFILE] > 0.5f ? "true" : "false")
+       << ",\"null_test\":" << (values[profiler::NULLTEST] > 0.5f ? "true" : "false")
+       << ",\"sequence\":" << (values[profiler::SEQUENCE] > 0.5f ? "true" : "false")
+       << ",\"progress\":" << values[profiler::STATE]
+       << ",\"meter\":" << values[profiler::METER]
+       << ",\"error\":" << int(values[profiler::ERRORS])
+       << ",\"take\":" << int(values[profiler::TAKE])
+       << ",\"null_depth\":" << values[profiler::NULLDEPTH]
+       << ",\"null_esr\":" << values[profiler::ESR]
+       << ",\"linear_esr\":" << values[profiler::FITESR]
+       << ",\"trim\":" << values[profiler::TRIM]
+       << ",\"headroom\":" << values[profiler::HEADROOM]
+       << "}";
+    return os.str();
+}
+
+// a status event of the profiler as json line
+static std::string event_line(const profiler::StatusEvent& ev) {
+    std::ostringstream os;
+    switch (ev.type) {
+    case profiler::EV_ERROR:
+        os << "{\"event\":\"error\",\"code\":" << ev.code;
+        if (ev.code == 9) os << ",\"headroom\":" << ev.value;
+        break;
+    case profiler::EV_LATENCY:
+        os << "{\"event\":\"latency\",\"latency\":" << ev.code << ",\"mtdm_error\":" << ev.value;
+        break;
+    case profiler::EV_CAPTURE:
+        os << "{\"event\":\"finished\",\"index\":" << ev.code << ",\"nf\":" << ev.value
+           << ",\"file\":" << profiler::json_string(ev.text);
+        break;
+    case profiler::EV_OVERRUN:
+        os << "{\"event\":\"overrun\",\"overruns\":" << ev.code;
+        break;
+    default:
+        return std::string();
+    }
+    os << ",\"time\":" << std::fixed << std::setprecision(3) << ev.time << "}";
+    return os.str();
+}
+
+static std::string error_line(const std::string& msg) {
+    return "{\"ok\":false,\"error\":" + profiler::json_string(msg) + "}";
+}
+
+// set a input port and keep the reported value in sync
+static void set_control(profiler::PortIndex port, float value) {
+    values[port] = value;
+    profiler::Profil::connect_ports(port, value, plug);
+}
+
+// the profiler reads the stimulus on activation, so swap it with the client stopped
+static bool select_stimulus(const std::string& fname) {
+    SF_INFO info;
+    memset(&info, 0, sizeof(info));
+    SNDFILE *sf = sf_open(fname.c_str(), SFM_READ, &info);
+    if (!sf) return false;
+    sf_close(sf);
+    jack_deactivate(client);
+    profiler::Profil::activate_plugin(false, plug);
+    profiler::Profil::set_stimulus(fname, plug);
+    profiler::Profil::activate_plugin(true, plug);
+    for (size_t i = 0; i < sizeof(controls) / sizeof(controls[0]); i++)
+        profiler::Profil::connect_ports(controls[i].port, values[controls[i].port], plug);
+    jack_activate(client);
+    auto_connect();
+    return true;
+}
+
+static void list_captures(Client& c) {
+    std::ifstream index((profiler::Profil::profile_path(plug) + "captures.jsonl").c_str());
+    std::string l;
+    int count = 0;
+    while (c.fd >= 0 && std::getline(index, l)) {
+        if (l.empty()) continue;
+        send_line(c, "{\"event\":\"capture\",\"entry\":" + l + "}");
+        count++;
+    }
+    if (c.fd >= 0) send_line(c, "{\"ok\":true,\"captures\":" + std::to_string(count) + "}");
+}
+
+// index 0 is input.wav, the library entries follow
+static void list_stimuli(Client& c) {
+    std::vector<std::string> lib = profiler::Profil::stimulus_library(plug);
+    send_line(c, "{\"event\":\"stimulus\",\"index\":0,\"file\":\"input.wav\"}");
+    for (size_t i = 0; i < lib.size() && c.fd >= 0; i++)
+        send_line(c, "{\"event\":\"stimulus\",\"index\":" + std::to_string(i + 1) +
+                     ",\"file\":" + profiler::json_string(lib[i]) + "}");
+    if (c.fd >= 0) send_line(c, "{\"ok\":true,\"stimuli\":" + std::to_string(lib.size() + 1) + "}");
+}
+
+static void command(Client& c, const std::string& l) {
+    std::istringstream is(l);
+    std::string cmd, arg;
+    is >> cmd;
+    const bool busy = values[profiler::PROFILE] > 0.5f || values[profiler::NULLTEST] > 0.5f ||
+                      values[profiler::SEQUENCE] > 0.5f;
+    if (cmd.empty()) {
+        return;
+    } else if (cmd == "start" || cmd == "null" || cmd == "sequence") {
+        if (busy) return send_line(c, error_line("busy"));
+        set_control(cmd == "start" ? profiler::PROFILE : cmd == "null" ? profiler::NULLTEST : profiler::SEQUENCE, 1.0f);
+    } else if (cmd == "stop") {
+        set_control(profiler::SEQUENCE, 0.0f);
+        set_control(profiler::NULLTEST, 0.0f);
+        set_control(profiler::PROFILE, 0.0f);
+    } else if (cmd == "set") {
+        float value = 0.0f;
+        if (!(is >> arg >> value)) return send_line(c, error_line("usage: set <control> <value>"));
+        size_t i = 0;
+        for (; i < sizeof(controls) / sizeof(controls[0]); i++)
+            if (arg == controls[i].name) break;
+        if (i == sizeof(controls) / sizeof(controls[0])) return send_line(c, error_line("unknown control " + arg));
+        set_control(controls[i].port, value);
+    } else if (cmd == "stimulus") {
+        std::getline(is >> std::ws, arg);
+        if (busy) return send_line(c, error_line("busy"));
+        if (arg.empty() || !select_stimulus(arg)) return send_line(c, error_line("could not open the stimulus"));
+    } else if (cmd == "status") {
+        return send_line(c, status_line());
+    } else if (cmd == "watch") {
+        is >> arg;
+        c.watch = arg != "off";
+    } else if (cmd == "captures") {
+        return list_captures(c);
+    } else if (cmd == "stimuli") {
+        return list_stimuli(c);
+    } else if (cmd == "quit") {
+        close(c.fd);
+        c.fd = -1;
+        return;
+    } else {
+        return send_line(c, error_line("unknown command " + cmd));
+    }
+    send_line(c, "{\"ok\":true}");
+}
+
+static int open_socket(const std::string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) || listen(fd, 8)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+// --------------------------------------------------------------------------------
+
+static void usage() {
+    fprintf(stderr,
+        "usage: neuralrecordd [options]\n"
+        "  -n name      jack client name (default: neuralrecord)\n"
+        "  -i port      connect the input to this port (default: first physical capture)\n"
+        "  -o port      connect the output to this port (default: first physical playback)\n"
+        "  -r port      connect the reference input to this port, the interface loopback\n"
+        "  -S path      control socket (default: $XDG_RUNTIME_DIR/neuralrecord.sock)\n"
+        "The stimulus is read from ~/profiles/input.wav, the targets are written\n"
+        "as ~/profiles/target_N.wav and listed in ~/profiles/captures.jsonl\n");
+}
+
+int main(int argc, char **argv) {
+    std::string name = "neuralrecord";
+    const char *rundir = getenv("XDG_RUNTIME_DIR");
+    std::string sockpath = std::string(rundir ? rundir : "/tmp") + "/neuralrecord.sock";
+    int c;
+    while ((c = getopt(argc, argv, "n:i:o:r:S:h")) != -1) {
+        switch (c) {
+        case 'n': name = optarg; break;
+        case 'i': capturename = optarg; break;
+        case 'o': playbackname = optarg; break;
+        case 'r': referencename = optarg; break;
+        case 'S': sockpath = optarg; break;
+        default: usage(); return 1;
+        }
+    }
+
+    client = jack_client_open(name.c_str(), JackNoStartServer, NULL);
+    if (!client) {
+        fprintf(stderr, "neuralrecordd: could not connect to the jack server\n");
+        return 1;
+    }
+    if (jack_get_sample_rate(client) != 48000)
+        fprintf(stderr, "neuralrecordd: the jack server runs at %u Hz, captures need 48kHz\n",
+                jack_get_sample_rate(client));
+    inport = jack_port_register(client, "in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    refport = jack_port_register(client, "reference", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+    outport = jack_port_register(client, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    midiport = jack_port_register(client, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+    if (!inport || !refport || !outport || !midiport) {
+        fprintf(stderr, "neuralrecordd: could not register the ports\n");
+        jack_client_close(client);
+        return 1;
+    }
+
+    for (int i = 0; i < profiler::CLIP; i++) {
+        values[i] = 0.0f;
+        release[i] = false;
+    }
+    values[profiler::SETTLE] = 2.0f;
+    values[profiler::NULLDEPTH] = -120.0f;
+    plug = new profiler::Profil(1,
+        [] (const uint32_t index, float value) { if (index < profiler::CLIP) values[index] = value; },
+        [] (const uint32_t index, float value) { if (index < profiler::CLIP && value < 0.5f) release[index] = true; },
+        [] (const uint32_t frame, const uint8_t *data, const uint32_t size) {
+            return midibuf && jack_midi_event_write(midibuf, frame, data, size) == 0; });
+    profiler::Profil::set_samplerate(jack_get_sample_rate(client), plug);
+    profiler::Profil::set_buffersize(jack_get_buffer_size(client), plug);
+    profiler::Profil::activate_plugin(true, plug);
+    jack_set_process_callback(client, process, NULL);
+    jack_on_shutdown(client, shutdown, NULL);
+    if (jack_activate(client)) {
+        fprintf(stderr, "neuralrecordd: could not activate the jack client\n");
+        jack_client_close(client);
+        return 1;
+    }
+    auto_connect();
+
+    int lfd = open_socket(sockpath);
+    if (lfd < 0) {
+        fprintf(stderr, "neuralrecordd: could not open %s\n", sockpath.c_str());
+        jack_client_close(client);
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "neuralrecordd: listening on %s\n", sockpath.c_str());
+
+    std::vector<Client> clients;
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while (!quit) {
+        std::vector<pollfd> fds(1);
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < clients.size(); i++) {
+            pollfd p = { clients[i].fd, POLLIN, 0 };
+            fds.push_back(p);
+        }
+        poll(&fds[0], fds.size(), WATCHRATE / 2);
+
+        // switches the profiler released by itself, a finished capture or a error
+        for (int i = 0; i < profiler::CLIP; i++)
+            if (release[i].exchange(false)) set_control(profiler::PortIndex(i), 0.0f);
+
+        // the status events go out once, to the watching clients
+        profiler::StatusEvent ev;
+        while (profiler::Profil::status_ring(plug)->pop(ev)) {
+            const std::string s = event_line(ev);
+            for (size_t i = 0; i < clients.size(); i++)
+                if (clients[i].fd >= 0 && clients[i].watch && !s.empty()) send_line(clients[i], s);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd >= 0) {
+                Client cl = { fd, false, std::string() };
+                clients.push_back(cl);
+            }
+        }
+        for (size_t i = 1; i < fds.size(); i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            Client& cl = clients[i - 1];
+            char buf[512];
+            ssize_t n = recv(cl.fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                close(cl.fd);
+                cl.fd = -1;
+                continue;
+            }
+            cl.line.append(buf, n);
+            size_t e;
+            while (cl.fd >= 0 && (e = cl.line.find('\n')) != std::string::npos) {
+                std::string l = cl.line.substr(0, e);
+                cl.line.erase(0, e + 1);
+                if (!l.empty() && l[l.size() - 1] == '\r') l.erase(l.size() - 1);
+                command(cl, l);
+            }
+            if (cl.line.size() > 4096) {
+                close(cl.fd);
+                cl.fd = -1;
+            }
+        }
+
+        if (std::chrono::steady_clock::now() >= next) {
+            next += std::chrono::milliseconds(WATCHRATE);
+            const std::string s = status_line();
+            for (size_t i = 0; i < clients.size(); i++)
+                if (clients[i].fd >= 0 && clients[i].watch) send_line(clients[i], s);
+        }
+        size_t k = 0;
+        for (size_t i = 0; i < clients.size(); i++)
+            if (clients[i].fd >= 0) clients[k++] = clients[i];
+        clients.resize(k);
+    }
+
+    for (size_t i = 0; i < clients.size(); i++) close(clients[i].fd);
+    close(lfd);
+    unlink(sockpath.c_str());
+    // release the switches, the last block is flushed by the worker
+    set_control(profiler::SEQUENCE, 0.0f);
+    set_control(profiler::NULLTEST, 0.0f);
+    set_control(profiler::PROFILE, 0.0f);
+    usleep(200000);
+    jack_deactivate(client);
+    jack_client_close(client);
+    profiler::Profil::activate_plugin(false, plug);
+    profiler::Profil::delete_instance(plug);
+    fprintf(stderr, "neuralrecordd: stopped\n");
+    return 0;
+}
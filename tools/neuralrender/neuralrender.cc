@@ -0,0 +1,388 @@
+/*
+ * Neural Render, offline capture of LV2 plugins with the Neural Record profiler
+ *
+ * SPDX-License-Identifier:  GPL-2.0 license 
+ *
+ * Copyright (C) 2023 brummer <brummer@web.de>
+ */
+
+// A software device didn't need to be captured in real time. Neural Render load a LV2 plugin
+// with lilv and put it in the loop where the external gear would be: the output of the profiler
+// is processed by the plugin and returned to the profiler input one block later. The capture runs
+// the same way as in the plug (roundtrip measurement, record, normalisation, capture index),
+// only as fast as the CPU allows. Presets could be rendered in parallel, one thread per preset.
+
+#include "profiler.cc"
+
+#include <lilv/lilv.h>
+#include <lv2/atom/atom.h>
+#include <lv2/buf-size/buf-size.h>
+#include <lv2/core/lv2.h>
+#include <lv2/options/options.h>
+#include <lv2/parameters/parameters.h>
+#include <lv2/presets/presets.h>
+#include <lv2/urid/urid.h>
+
+#include <deque>
+
+#define RENDERRATE 48000
+#define ATOMSIZE 8192
+
+// --------------------------------------------------------------------------------
+
+// urid map shared by all plugin instances, a deque keeps the strings in place while it grows,
+// so the pointers handed out by unmap_uri() stay valid
+static std::mutex urimutex;
+static std::deque<std::string> uris;
+
+static LV2_URID map_uri(LV2_URID_Map_Handle, const char *uri) {
+    std::lock_guard<std::mutex> lk(urimutex);
+    for (size_t i = 0; i < uris.size(); i++)
+        if (uris[i] == uri) return i + 1;
+    uris.push_back(uri);
+    return uris.size();
+}
+
+static const char *unmap_uri(LV2_URID_Unmap_Handle, LV2_URID urid) {
+    std::lock_guard<std::mutex> lk(urimutex);
+    return (urid && urid <= uris.size()) ? uris[urid - 1].c_str() : NULL;
+}
+
+static LV2_URID_Map urid_map = { NULL, map_uri };
+static LV2_URID_Unmap urid_unmap = { NULL, unmap_uri };
+
+// --------------------------------------------------------------------------------
+
+// one capture, a plugin instance with its state and port buffers
+struct Job
+{
+    std::string          label;
+    LilvInstance         *instance;
+    std::vector<float>   controls;
+    std::vector<int>     ains;
+    std::vector<int>     aouts;
+    std::vector<int>     atomouts;
+    std::vector<uint64_t> atombuf;
+    std::vector<float>   audio;
+    std::vector<float>   scratch;
+    const LilvPlugin     *plugin;
+    int                  error;
+};
+
+struct Options
+{
+    int   blocksize;
+    int   jobs;
+    float calibrate;
+    float exportformat;
+    float split;
+    std::vector<std::pair<std::string, float> > controls;
+};
+
+// --------------------------------------------------------------------------------
+
+// find the control port for a symbol
+static int port_by_symbol(LilvWorld *world, const LilvPlugin *plugin, const char *symbol) {
+    LilvNode *sym = lilv_new_string(world, symbol);
+    const LilvPort *port = lilv_plugin_get_port_by_symbol(plugin, sym);
+    lilv_node_free(sym);
+    return port ? int(lilv_port_get_index(plugin, port)) : -1;
+}
+
+// preset values come in by port symbol
+struct Restore
+{
+    LilvWorld *world;
+    Job       *job;
+};
+
+static void set_port_value(const char *symbol, void *data, const void *value, uint32_t size, uint32_t type) {
+    Restore *r = static_cast<Restore*>(data);
+    int p = port_by_symbol(r->world, r->job->plugin, symbol);
+    if (p < 0) return;
+    if (type == map_uri(NULL, LV2_ATOM__Float) && size == sizeof(float))
+        r->job->controls[p] = *static_cast<const float*>(value);
+    else if (type == map_uri(NULL, LV2_ATOM__Double) && size == sizeof(double))
+        r->job->controls[p] = *static_cast<const double*>(value);
+    else if (type == map_uri(NULL, LV2_ATOM__Int) && size == sizeof(int32_t))
+        r->job->controls[p] = *static_cast<const int32_t*>(value);
+    else if (type == map_uri(NULL, LV2_ATOM__Bool) && size == sizeof(int32_t))
+        r->job->controls[p] = *static_cast<const int32_t*>(value) ? 1.0f : 0.0f;
+}
+
+// instantiate the plugin, connect the ports and load the preset when one is given
+static bool setup_job(LilvWorld *world, const LilvPlugin *plugin, const LilvNode *preset,
+                      const Options& opt, const LV2_Feature *const *features, Job *job) {
+    job->plugin = plugin;
+    job->error = 0;
+    job->label.clear();
+    job->ains.clear();
+    job->aouts.clear();
+    job->atomouts.clear();
+    job->instance = lilv_plugin_instantiate(plugin, RENDERRATE, features);
+    if (!job->instance) return false;
+
+    LilvNode *audio = lilv_new_uri(world, LV2_CORE__AudioPort);
+    LilvNode *control = lilv_new_uri(world, LV2_CORE__ControlPort);
+    LilvNode *atom = lilv_new_uri(world, LV2_ATOM__AtomPort);
+    LilvNode *input = lilv_new_uri(world, LV2_CORE__InputPort);
+    LilvNode *optional = lilv_new_uri(world, LV2_CORE__connectionOptional);
+
+    const uint32_t nports = lilv_plugin_get_num_ports(plugin);
+    job->controls.assign(nports, 0.0f);
+    std::vector<float> defaults(nports);
+    lilv_plugin_get_port_ranges_float(plugin, NULL, NULL, &defaults[0]);
+
+    int natoms = 0;
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < nports; i++) {
+        const LilvPort *port = lilv_plugin_get_port_by_index(plugin, i);
+        if (lilv_port_is_a(plugin, port, audio)) {
+            if (lilv_port_is_a(plugin, port, input)) job->ains.push_back(i);
+            else job->aouts.push_back(i);
+        } else if (lilv_port_is_a(plugin, port, control)) {
+            job->controls[i] = std::isnan(defaults[i]) ? 0.0f : defaults[i];
+        } else if (lilv_port_is_a(plugin, port, atom)) {
+            natoms++;
+        } else if (!lilv_port_has_property(plugin, port, optional)) {
+            fprintf(stderr, "neuralrender: port %u has a unsupported type\n", i);
+            ok = false;
+        }
+    }
+    if (ok && (job->ains.empty() || job->aouts.empty())) {
+        fprintf(stderr, "neuralrender: the plugin needs a audio input and output\n");
+        ok = false;
+    }
+    if (!ok) {
+        lilv_node_free(audio);
+        lilv_node_free(control);
+        lilv_node_free(atom);
+        lilv_node_free(input);
+        lilv_node_free(optional);
+        lilv_instance_free(job->instance);
+        job->instance = NULL;
+        return false;
+    }
+
+    // all audio inputs get the stimulus, the first output is the returning signal
+    job->audio.assign(opt.blocksize * 2, 0.0f);
+    job->scratch.assign(opt.blocksize * job->aouts.size(), 0.0f);
+    for (size_t i = 0; i < job->ains.size(); i++)
+        lilv_instance_connect_port(job->instance, job->ains[i], &job->audio[0]);
+    lilv_instance_connect_port(job->instance, job->aouts[0], &job->audio[opt.blocksize]);
+    for (size_t i = 1; i < job->aouts.size(); i++)
+        lilv_instance_connect_port(job->instance, job->aouts[i], &job->scratch[i * opt.blocksize]);
+
+    // atom ports get a empty sequence, outputs are reset before each run
+    const size_t words = ATOMSIZE / sizeof(uint64_t);
+    job->atombuf.assign(natoms * words, 0);
+    int a = 0;
+    for (uint32_t i = 0; i < nports; i++) {
+        const LilvPort *port = lilv_plugin_get_port_by_index(plugin, i);
+        if (lilv_port_is_a(plugin, port, control)) {
+            lilv_instance_connect_port(job->instance, i, &job->controls[i]);
+        } else if (lilv_port_is_a(plugin, port, atom)) {
+            LV2_Atom_Sequence *seq = reinterpret_cast<LV2_Atom_Sequence*>(&job->atombuf[a * words]);
+            seq->atom.type = map_uri(NULL, LV2_ATOM__Sequence);
+            seq->atom.size = sizeof(LV2_Atom_Sequence_Body);
+            if (!lilv_port_is_a(plugin, port, input)) job->atomouts.push_back(a);
+            lilv_instance_connect_port(job->instance, i, seq);
+            a++;
+        }
+    }
+    lilv_node_free(audio);
+    lilv_node_free(control);
+    lilv_node_free(atom);
+    lilv_node_free(input);
+    lilv_node_free(optional);
+
+    if (preset) {
+        lilv_world_load_resource(world, preset);
+        LilvState *state = lilv_state_new_from_world(world, &urid_map, preset);
+        if (state) {
+            Restore r = { world, job };
+            lilv_state_restore(state, job->instance, set_port_value, &r, 0, features);
+            job->label = lilv_state_get_label(state) ? lilv_state_get_label(state) : lilv_node_as_string(preset);
+            lilv_state_free(state);
+        }
+    }
+    for (size_t i = 0; i < opt.controls.size(); i++) {
+        int p = port_by_symbol(world, plugin, opt.controls[i].first.c_str());
+        if (p >= 0) job->controls[p] = opt.controls[i].second;
+        else fprintf(stderr, "neuralrender: no control port %s\n", opt.controls[i].first.c_str());
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------------
+
+// run one capture through the plugin, as fast as the worker could write it
+static void render_job(Job *job, const Options& opt) {
+    std::atomic<int> error(0);
+    std::atomic<bool> done(false);
+    profiler::Profil *p = new profiler::Profil(1,
+        [&error] (const uint32_t index, float value) { if (index == profiler::ERRORS && value > 0.5f) error = int(value); },
+        [&done] (const uint32_t index, float value) { if (index == profiler::PROFILE && value < 0.5f) done = true; },
+        [] (const uint32_t, const uint8_t*, const uint32_t) { return false; });
+    p->set_samplerate(RENDERRATE, p);
+    p->activate_plugin(true, p);
+    if (!job->label.empty()) profiler::Profil::label_take("preset", job->label, p);
+    p->connect_ports(profiler::CALIBRATE, opt.calibrate, p);
+    p->connect_ports(profiler::EXPORT, opt.exportformat, p);
+    p->connect_ports(profiler::SPLIT, opt.split, p);
+
+    const int bs = opt.blocksize;
+    std::vector<float> in(bs, 0.0f), out(bs, 0.0f);
+    const size_t words = ATOMSIZE / sizeof(uint64_t);
+    lilv_instance_activate(job->instance);
+    p->connect_ports(profiler::PROFILE, 1.0f, p);
+    // stop after a hour at the latest
+    for (long cycles = 0; !done && cycles < long(RENDERRATE) * 3600 / bs; cycles++) {
+        p->mono_audio(bs, &in[0], &out[0], p);
+        std::copy(out.begin(), out.end(), job->audio.begin());
+        for (size_t i = 0; i < job->atomouts.size(); i++) {
+            LV2_Atom_Sequence *seq = reinterpret_cast<LV2_Atom_Sequence*>(&job->atombuf[job->atomouts[i] * words]);
+            seq->atom.type = map_uri(NULL, LV2_ATOM__Chunk);
+            seq->atom.size = ATOMSIZE - sizeof(LV2_Atom);
+        }
+        lilv_instance_run(job->instance, bs);
+        // the device output comes back one block later
+        std::copy(job->audio.begin() + bs, job->audio.begin() + 2 * bs, in.begin());
+        profiler::Profil::sync_worker(p);
+    }
+    // release the capture switch and flush the rest
+    p->connect_ports(profiler::PROFILE, 0.0f, p);
+    p->mono_audio(bs, &in[0], &out[0], p);
+    profiler::Profil::sync_worker(p);
+    lilv_instance_deactivate(job->instance);
+    job->error = error;
+    p->activate_plugin(false, p);
+    profiler::Profil::delete_instance(p);
+}
+
+// --------------------------------------------------------------------------------
+
+static void usage() {
+    fprintf(stderr,
+        "usage: neuralrender [options] plugin-uri\n"
+        "  -P preset-uri   render this preset, could be given several times\n"
+        "  -A              render all presets of the plugin\n"
+        "  -p symbol=value set a control port of the plugin\n"
+        "  -j jobs         render that many presets in parallel (default: all cores)\n"
+        "  -b frames       block size (default: 256)\n"
+        "  -c              calibrate the input level before each capture\n"
+        "  -e float|pcm24  export a training ready pair for each capture\n"
+        "  -s percent      validation split of the export\n"
+        "The stimulus is read from ~/profiles/input.wav, the targets are written\n"
+        "as ~/profiles/target_N.wav and listed in ~/profiles/captures.jsonl\n");
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    opt.blocksize = 256;
+    opt.jobs = std::max(1u, std::thread::hardware_concurrency());
+    opt.calibrate = 0.0;
+    opt.exportformat = 0.0;
+    opt.split = 0.0;
+    std::vector<std::string> presets;
+    bool allpresets = false;
+    int c;
+    while ((c = getopt(argc, argv, "P:Ap:j:b:ce:s:h")) != -1) {
+        switch (c) {
+        case 'P': presets.push_back(optarg); break;
+        case 'A': allpresets = true; break;
+        case 'p': {
+            std::string a = optarg;
+            size_t e = a.find('=');
+            if (e == std::string::npos) { usage(); return 1; }
+            opt.controls.push_back(std::make_pair(a.substr(0, e), float(atof(a.c_str() + e + 1))));
+            break;
+        }
+        case 'j': opt.jobs = std::max(1, atoi(optarg)); break;
+        case 'b': opt.blocksize = std::min(8192, std::max(16, atoi(optarg))); break;
+        case 'c': opt.calibrate = 1.0; break;
+        case 'e': opt.exportformat = strcmp(optarg, "pcm24") == 0 ? 2.0 : 1.0; break;
+        case 's': opt.split = atof(optarg); break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    LilvWorld *world = lilv_world_new();
+    lilv_world_load_all(world);
+    LilvNode *uri = lilv_new_uri(world, argv[optind]);
+    const LilvPlugin *plugin = lilv_plugins_get_by_uri(lilv_world_get_all_plugins(world), uri);
+    lilv_node_free(uri);
+    if (!plugin) {
+        fprintf(stderr, "neuralrender: plugin %s not found\n", argv[optind]);
+        lilv_world_free(world);
+        return 1;
+    }
+
+    // the host features most plugins ask for
+    const int32_t blocklength = opt.blocksize;
+    const float samplerate = RENDERRATE;
+    LV2_Options_Option options[] = {
+        { LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_BUF_SIZE__minBlockLength), sizeof(int32_t), map_uri(NULL, LV2_ATOM__Int), &blocklength },
+        { LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_BUF_SIZE__maxBlockLength), sizeof(int32_t), map_uri(NULL, LV2_ATOM__Int), &blocklength },
+        { LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_BUF_SIZE__nominalBlockLength), sizeof(int32_t), map_uri(NULL, LV2_ATOM__Int), &blocklength },
+        { LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_PARAMETERS__sampleRate), sizeof(float), map_uri(NULL, LV2_ATOM__Float), &samplerate },
+        { LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+    };
+    LV2_Feature map_feature = { LV2_URID__map, &urid_map };
+    LV2_Feature unmap_feature = { LV2_URID__unmap, &urid_unmap };
+    LV2_Feature options_feature = { LV2_OPTIONS__options, options };
+    LV2_Feature bounded_feature = { LV2_BUF_SIZE__boundedBlockLength, NULL };
+    const LV2_Feature *features[] = { &map_feature, &unmap_feature, &options_feature, &bounded_feature, NULL };
+
+    // collect the presets to render
+    std::vector<LilvNode*> nodes;
+    for (size_t i = 0; i < presets.size(); i++) nodes.push_back(lilv_new_uri(world, presets[i].c_str()));
+    if (allpresets) {
+        LilvNode *pclass = lilv_new_uri(world, LV2_PRESETS__Preset);
+        LilvNodes *related = lilv_plugin_get_related(plugin, pclass);
+        LILV_FOREACH(nodes, i, related) nodes.push_back(lilv_node_duplicate(lilv_nodes_get(related, i)));
+        lilv_nodes_free(related);
+        lilv_node_free(pclass);
+    }
+    if (nodes.empty()) nodes.push_back(NULL);
+
+    // lilv isn't thread safe, so all instances are set up here
+    std::vector<Job> jobs(nodes.size());
+    size_t njobs = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (setup_job(world, plugin, nodes[i], opt, features, &jobs[njobs])) njobs++;
+        else fprintf(stderr, "neuralrender: could not instantiate %s\n", nodes[i] ? lilv_node_as_string(nodes[i]) : argv[optind]);
+    }
+    jobs.resize(njobs);
+
+    // the post processing pool only gets the cores the renders leave free
+    const int running = std::min<int>(opt.jobs, njobs);
+    profiler::Profil::set_pool_threads(int(std::thread::hardware_concurrency()) - running);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < running; t++) {
+        threads.push_back(std::thread([&jobs, &next, &opt] () {
+            for (size_t j = next++; j < jobs.size(); j = next++) render_job(&jobs[j], opt);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+    int ret = njobs == nodes.size() ? 0 : 1;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const char *name = jobs[i].label.empty() ? "default" : jobs[i].label.c_str();
+        if (jobs[i].error && jobs[i].error != 5 && jobs[i].error != 6) {
+            fprintf(stderr, "neuralrender: %s failed with error %i\n", name, jobs[i].error);
+            ret = 1;
+        } else {
+            fprintf(stderr, "neuralrender: %s captured\n", name);
+        }
+        lilv_instance_free(jobs[i].instance);
+    }
+    for (size_t i = 0; i < nodes.size(); i++) if (nodes[i]) lilv_node_free(nodes[i]);
+    lilv_world_free(world);
+    return ret;
+}